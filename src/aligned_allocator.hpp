@@ -0,0 +1,56 @@
+#pragma once
+#ifndef IDOCK_ALIGNED_ALLOCATOR_HPP
+#define IDOCK_ALIGNED_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <new>
+using namespace std;
+
+//! Allocates arrays aligned to a boundary of the given number of bytes, so that records never straddle cache lines and buffers start at a page.
+template <typename T, size_t alignment>
+class aligned_allocator
+{
+public:
+	static_assert(alignment >= alignof(T) && (alignment & (alignment - 1)) == 0, "alignment must be a power of 2 no less than that of T");
+
+	using value_type = T;
+
+	template <typename U>
+	struct rebind
+	{
+		using other = aligned_allocator<U, alignment>;
+	};
+
+	aligned_allocator() noexcept = default;
+
+	template <typename U>
+	aligned_allocator(const aligned_allocator<U, alignment>&) noexcept
+	{
+	}
+
+	//! Allocates uninitialized storage for n objects.
+	T* allocate(const size_t n)
+	{
+		return static_cast<T*>(::operator new(sizeof(T) * n, align_val_t(alignment)));
+	}
+
+	//! Deallocates storage obtained from allocate.
+	void deallocate(T* const p, const size_t) noexcept
+	{
+		::operator delete(p, align_val_t(alignment));
+	}
+
+	template <typename U>
+	bool operator==(const aligned_allocator<U, alignment>&) const noexcept
+	{
+		return true;
+	}
+
+	template <typename U>
+	bool operator!=(const aligned_allocator<U, alignment>&) const noexcept
+	{
+		return false;
+	}
+};
+
+#endif
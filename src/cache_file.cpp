@@ -0,0 +1,161 @@
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <boost/interprocess/file_mapping.hpp>
+#include "cache_file.hpp"
+using namespace boost::interprocess;
+
+//! Magic number identifying a cache file.
+static const char magic[8] = { 'J', 'D', 'O', 'C', 'K', 'B', 'L', 'K' };
+
+//! Version of the cache file layout. Bump it whenever the layout changes.
+static const uint64_t version = 1;
+
+//! Returns n rounded up to the nearest multiple of cache_file::alignment.
+static size_t align(const size_t n)
+{
+	return (n + cache_file::alignment - 1) / cache_file::alignment * cache_file::alignment;
+}
+
+cache_file::cache_file(const path& p, const uint64_t key, const size_t num_blocks, const size_t block_size)
+	: p(p)
+	, key(key)
+	, num_blocks(num_blocks)
+	, block_size(block_size)
+	, blocks(num_blocks)
+{
+	unique_ptr<mapped_region> region;
+	const auto offsets = load(p, region);
+	if (offsets.empty())
+		return;
+	const auto base = static_cast<const char*>(region->get_address());
+	for (size_t i = 0; i < num_blocks; ++i)
+	{
+		if (offsets[i])
+			blocks[i] = base + offsets[i];
+	}
+	regions.push_back(move(region));
+}
+
+const void* cache_file::block(const size_t i) const
+{
+	return blocks[i];
+}
+
+vector<size_t> cache_file::load(const path& file, unique_ptr<mapped_region>& region) const
+{
+	// The header consists of the magic number, version, key, number of blocks, block size and block offsets.
+	const size_t header_size = sizeof(magic) + sizeof(uint64_t) * (4 + num_blocks);
+	error_code ec;
+	const auto file_size = std::filesystem::file_size(file, ec);
+	if (ec || file_size < header_size)
+		return {};
+
+	try
+	{
+		const file_mapping mapping(file.string().c_str(), read_only);
+		region = make_unique<mapped_region>(mapping, read_only);
+	}
+	catch (const interprocess_exception&)
+	{
+		return {};
+	}
+
+	// Validate the header.
+	const auto base = static_cast<const char*>(region->get_address());
+	uint64_t fields[4];
+	memcpy(fields, base + sizeof(magic), sizeof(fields));
+	if (memcmp(base, magic, sizeof(magic)) || fields[0] != version || fields[1] != key || fields[2] != num_blocks || fields[3] != block_size)
+		return {};
+
+	// Validate block offsets. Offset 0 denotes an absent block because the header always occupies it.
+	vector<size_t> offsets(num_blocks);
+	for (size_t i = 0; i < num_blocks; ++i)
+	{
+		uint64_t offset;
+		memcpy(&offset, base + sizeof(magic) + sizeof(fields) + sizeof(uint64_t) * i, sizeof(offset));
+		if (offset && (offset % alignment || offset + block_size > file_size))
+			return {};
+		offsets[i] = offset;
+	}
+	return offsets;
+}
+
+bool cache_file::append(const vector<pair<size_t, const void*>>& new_blocks)
+{
+	// Gather the blocks to write, including those cached by other processes since this file was opened.
+	vector<const void*> sources(blocks);
+	unique_ptr<mapped_region> latest;
+	const auto latest_offsets = load(p, latest);
+	for (size_t i = 0; i < latest_offsets.size(); ++i)
+	{
+		if (!sources[i] && latest_offsets[i])
+			sources[i] = static_cast<const char*>(latest->get_address()) + latest_offsets[i];
+	}
+	for (const auto& [i, data] : new_blocks)
+	{
+		if (!sources[i])
+			sources[i] = data;
+	}
+
+	// Lay out the blocks after the header.
+	const size_t header_size = sizeof(magic) + sizeof(uint64_t) * (4 + num_blocks);
+	vector<uint64_t> header{ version, key, num_blocks, block_size };
+	header.resize(4 + num_blocks);
+	size_t offset = align(header_size);
+	for (size_t i = 0; i < num_blocks; ++i)
+	{
+		if (!sources[i])
+			continue;
+		header[4 + i] = offset;
+		offset += align(block_size);
+	}
+
+	// Write to a uniquely named temporary file first, so that readers never observe a partially written cache file.
+	path tmp = p;
+	tmp += '.' + to_string(random_device()()) + ".tmp";
+	{
+		ofstream ofs(tmp, ios::binary);
+		const vector<char> zeros(alignment);
+		ofs.write(magic, sizeof(magic));
+		ofs.write(reinterpret_cast<const char*>(header.data()), sizeof(uint64_t) * header.size());
+		ofs.write(zeros.data(), align(header_size) - header_size);
+		for (const auto data : sources)
+		{
+			if (!data)
+				continue;
+			ofs.write(static_cast<const char*>(data), block_size);
+			ofs.write(zeros.data(), align(block_size) - block_size);
+		}
+		if (!ofs)
+		{
+			ofs.close();
+			error_code ec;
+			remove(tmp, ec);
+			return false;
+		}
+	}
+
+	// Map the temporary file before renaming it, so that the mapping refers to the content written here even if another process replaces the cache file in the meantime.
+	unique_ptr<mapped_region> region;
+	const auto offsets = load(tmp, region);
+	error_code ec;
+	if (offsets.empty())
+	{
+		remove(tmp, ec);
+		return false;
+	}
+	rename(tmp, p, ec);
+	if (ec)
+		remove(tmp, ec);
+
+	// Point absent blocks to the new mapping. Blocks already handed out keep their addresses.
+	const auto base = static_cast<const char*>(region->get_address());
+	for (size_t i = 0; i < num_blocks; ++i)
+	{
+		if (!blocks[i] && offsets[i])
+			blocks[i] = base + offsets[i];
+	}
+	regions.push_back(move(region));
+	return true;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#ifndef IDOCK_CACHE_FILE_HPP
+#define IDOCK_CACHE_FILE_HPP
+
+#include <vector>
+#include <memory>
+#include <filesystem>
+#include <boost/interprocess/mapped_region.hpp>
+using namespace std;
+using namespace std::filesystem;
+
+//! Represents a versioned file of fixed-size page-aligned data blocks, which is memory mapped read-only so that concurrent processes share one physical copy through the page cache.
+class cache_file
+{
+public:
+	static const size_t alignment = 4096; //!< Alignment of the header and of every block within the file.
+
+	//! Opens the cache file and maps it if it exists and its header matches the given key, number of blocks and block size.
+	explicit cache_file(const path& p, const uint64_t key, const size_t num_blocks, const size_t block_size);
+
+	//! Returns the address of the given block, or nullptr if the block is not cached.
+	const void* block(const size_t i) const;
+
+	//! Writes the given blocks together with all the cached ones to a new file, maps it, and atomically replaces the cache file with it. Returns false if the file cannot be written.
+	//! Addresses returned earlier by block() remain valid for the lifetime of this object.
+	bool append(const vector<pair<size_t, const void*>>& new_blocks);
+
+private:
+	//! Maps the file at the given path and returns its block offsets, or an empty vector if the file is absent or does not match the header.
+	vector<size_t> load(const path& file, unique_ptr<boost::interprocess::mapped_region>& region) const;
+
+	const path p; //!< Path to the cache file.
+	const uint64_t key; //!< Content key that the cache file must match.
+	const size_t num_blocks; //!< Maximum number of blocks.
+	const size_t block_size; //!< Size of every block in bytes.
+	vector<const void*> blocks; //!< Addresses of cached blocks, nullptr if absent.
+	vector<unique_ptr<boost::interprocess::mapped_region>> regions; //!< All the regions mapped so far, kept alive so that handed out addresses never dangle.
+};
+
+#endif
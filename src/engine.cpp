@@ -0,0 +1,207 @@
+#include <sstream>
+#include "engine.hpp"
+#include "pka.hpp"
+#include "hash.hpp"
+
+engine::engine(istream& receptor_pdbqt, const settings& config, ostream& log)
+	: construction(stopwatch::start_new())
+	, config(config)
+	, scheduler(config.num_threads)
+	, f(config.num_trees, config.seed)
+	, rec(config.use_maps ? receptor(receptor_pdbqt, config.remove_nonstd, config.center, config.size, config.granularity, config.trilinear, config.gradient_maps, config.blocked_maps, config.huge_pages) : receptor(receptor_pdbqt, config.remove_nonstd))
+{
+	times.add(parsing_receptor, construction);
+	log << "Found " << rec.atoms.size() << " atoms in " << rec.residues.size() << " residues in the receptor" << endl;
+	log << "Using " << config.num_threads << " worker threads" << endl;
+
+	// Open the scoring function and grid map caches.
+	if (!config.cache.empty())
+	{
+		log << "Using cache in " << config.cache << endl;
+		sf.open_cache(config.cache);
+		if (rec.use_maps)
+		{
+			rec.open_cache(config.cache);
+		}
+	}
+
+	if (config.with_rf_score)
+	{
+		// Train RF-Score on the fly.
+		log << "Training a random forest of " << config.num_trees << " trees with " << tree::nv << " variables and " << tree::ns << " samples" << endl;
+		const auto sw = stopwatch::start_new();
+		task_group tasks(scheduler);
+		for (size_t i = 0; i < config.num_trees; ++i)
+		{
+			tasks.run([&, i]()
+				{
+					f[i].train(8, f.u01_s);
+				});
+		}
+		tasks.wait();
+		f.clear();
+		times.add(training_random_forest, sw);
+	}
+}
+
+bool engine::prepare(const ligand& lig, stage_times& times, event_counts& events)
+{
+	// Precalculate the scoring function of the ligand atom types crossed with the receptor and ligand atom types, the only combinations the ligand reads.
+	auto sw = stopwatch::start_new();
+	array<bool, scoring_function::n> xs = rec.xs;
+	for (size_t t = 0; t < scoring_function::n; ++t)
+	{
+		xs[t] = xs[t] || lig.xs[t];
+	}
+	const bool sf_cached = sf.precalculate(lig.xs, xs, scheduler);
+	times.add(precalculating_scoring_function, sw);
+	if (!rec.use_maps)
+		return sf_cached;
+
+	sw.restart();
+	event_scope scope(events);
+	lock_guard<mutex> guard(maps_mutex);
+	const bool cached = rec.create_maps(lig.xs, sf, scheduler);
+	times.add(creating_maps, sw);
+	return cached && sf_cached;
+}
+
+vector<result> engine::dock(const ligand& lig, const uint64_t key, stage_times& times, event_counts& events)
+{
+	// Run the Monte Carlo tasks.
+	vector<vector<result>> result_containers(config.num_tasks);
+	{
+		task_group tasks(scheduler);
+		for (size_t i = 0; i < config.num_tasks; ++i)
+		{
+			result_containers[i].reserve(20); // Maximum number of results obtained from a single Monte Carlo task.
+			tasks.run([&, i]()
+				{
+					const auto sw = stopwatch::start_new();
+					event_scope scope(events);
+					lig.monte_carlo(result_containers[i], splitmix64(key, i), sf, rec);
+					times.add(monte_carlo, sw);
+				});
+		}
+		tasks.wait();
+	}
+
+	// Merge results from all tasks into one single result container.
+	const auto sw = stopwatch::start_new();
+	event_scope scope(events);
+	vector<result> results;
+	results.reserve(config.max_conformations);
+	const double required_square_error = static_cast<double>(4 * lig.num_heavy_atoms); // Ligands with RMSD < 2.0 will be clustered into the same cluster.
+	for (auto& result_container : result_containers)
+	{
+		for (auto& result : result_container)
+		{
+			result::push(results, move(result), required_square_error);
+		}
+	}
+	times.add(clustering, sw);
+	return results;
+}
+
+void engine::finish(const ligand& lig, vector<result>& results, vector<bool>& mask, stage_times& times) const
+{
+	if (results.empty())
+		return;
+
+	// Adjust free energy relative to the best conformation and flexibility.
+	stopwatch rf_sw, by_comp_sw;
+	const double best_result_intra_e = results.front().e - results.front().f;
+	for (auto& result : results)
+	{
+		result.e_nd = (result.e - best_result_intra_e) * lig.flexibility_penalty_factor;
+		if (config.with_rf_score)
+		{
+			rf_sw.start();
+			result.rf = lig.calculate_rf_score(result, rec, f);
+			rf_sw.stop();
+		}
+		// Result from compose_result is not complete and need to be completed.
+		by_comp_sw.start();
+		lig.calculate_by_comp(result, sf, rec, mask);
+		by_comp_sw.stop();
+	}
+	times.add(rf_scoring, rf_sw);
+	times.add(decomposing, by_comp_sw);
+}
+
+result engine::score(const ligand& lig, const array<double, 3>& origin, const bool precise, vector<bool>& mask, stage_times& times) const
+{
+	// Scoring the input conformation counts as decomposing, which dominates it.
+	auto sw = stopwatch::start_new();
+	if (precise)
+	{
+		// The returned result is complete with per residue/heavy_atom energy.
+		auto r0 = lig.complete_result_noconf(origin, sf, rec, mask);
+		r0.e_nd = r0.f * lig.flexibility_penalty_factor;
+		times.add(decomposing, sw);
+		if (config.with_rf_score)
+		{
+			sw.restart();
+			r0.rf = lig.calculate_rf_score(r0, rec, f);
+			times.add(rf_scoring, sw);
+		}
+		return r0;
+	}
+
+	conformation c0(lig.num_active_torsions);
+	c0.position = origin;
+	double e0, f0;
+	change g0(lig.num_active_torsions);
+	workspace w0 = lig.create_workspace();
+	lig.evaluate(c0, sf, rec, -99, e0, f0, g0, w0);
+	auto r0 = lig.compose_result(e0, f0, c0, false, w0);
+	r0.e_nd = r0.f * lig.flexibility_penalty_factor;
+	sw.stop();
+	if (config.with_rf_score)
+	{
+		const auto rf_sw = stopwatch::start_new();
+		r0.rf = lig.calculate_rf_score(r0, rec, f);
+		times.add(rf_scoring, rf_sw);
+	}
+	// Result from compose_result is not complete and need to be completed.
+	sw.start();
+	lig.calculate_by_comp(r0, sf, rec, mask);
+	times.add(decomposing, sw);
+	return r0;
+}
+
+vector<result> engine::dock(const string& ligand_pdbqt, ostream& os)
+{
+	auto sw = stopwatch::start_new();
+	istringstream iss(ligand_pdbqt);
+	array<double, 3> origin;
+	const ligand lig(iss, origin, pka(), config.ph);
+	times.add(parsing_ligand, sw);
+	if (!lig.num_heavy_atoms)
+		throw runtime_error("no heavy atom is found in the ligand");
+	if (!rec.use_maps)
+		throw runtime_error("docking requires grid maps");
+	prepare(lig, times, events);
+
+	// The content keys the seeds so that the same ligand is always docked the same way.
+	auto results = dock(lig, fnv1a(ligand_pdbqt, fnv1a(&config.seed, sizeof(config.seed))), times, events);
+	vector<bool> mask(rec.residues.size());
+	finish(lig, results, mask, times);
+	sw.restart();
+	lig.write_models(os, results, rec);
+	times.add(writing_output, sw);
+	return results;
+}
+
+result engine::score(const string& ligand_pdbqt)
+{
+	const auto sw = stopwatch::start_new();
+	istringstream iss(ligand_pdbqt);
+	array<double, 3> origin;
+	const ligand lig(iss, origin, pka(), config.ph);
+	times.add(parsing_ligand, sw);
+	prepare(lig, times, events);
+	event_scope scope(events);
+	vector<bool> mask(rec.residues.size());
+	return score(lig, origin, !rec.use_maps, mask, times);
+}
@@ -0,0 +1,80 @@
+#pragma once
+#ifndef IDOCK_ENGINE_HPP
+#define IDOCK_ENGINE_HPP
+
+#include <istream>
+#include <ostream>
+#include <mutex>
+#include "scoring_function.hpp"
+#include "random_forest.hpp"
+#include "receptor.hpp"
+#include "ligand.hpp"
+#include "task_scheduler.hpp"
+#include "stage_times.hpp"
+#include "events.hpp"
+
+//! Represents a docking engine, the entry point of libjdock. It keeps a task scheduler, a precalculated scoring function, an optionally trained random forest, and a receptor with its grid maps in memory, and docks or scores ligands given as PDBQT buffers. Methods taking stage times and event counts accumulate the time spent in each stage and the events of hot paths into them.
+class engine
+{
+private:
+	stopwatch construction; //!< Started before the other members are initialized, so that parsing the receptor is timed.
+public:
+	//! Represents the settings of an engine, defaulting to those of the command line.
+	class settings
+	{
+	public:
+		array<double, 3> center = {}; //!< Search space center.
+		array<double, 3> size = {}; //!< Search space size in Angstrom.
+		double granularity = 0.125; //!< Density of probe atoms of grid maps.
+		bool use_maps = true; //!< Whether grid maps are created. Without grid maps, ligands can only be scored precisely.
+		bool trilinear = false; //!< Whether grid maps are trilinearly interpolated.
+		bool gradient_maps = false; //!< Whether grid maps store precalculated gradients.
+		bool blocked_maps = false; //!< Whether grid maps are laid out in blocks of probes.
+		bool huge_pages = false; //!< Whether grid maps are advised to be backed by huge pages.
+		bool remove_nonstd = false; //!< Whether non standard residues are removed from the receptor.
+		path cache; //!< Folder of scoring function and grid map cache files, or empty for no cache.
+		size_t num_threads = thread::hardware_concurrency(); //!< Number of worker threads.
+		size_t seed = 0; //!< Global seed, from which the seeds of a ligand are derived.
+		size_t num_tasks = 64; //!< Number of Monte Carlo tasks per ligand.
+		size_t max_conformations = 9; //!< Maximum number of conformations per ligand.
+		bool with_rf_score = false; //!< Whether a random forest is trained to compute RF-Score.
+		size_t num_trees = 500; //!< Number of decision trees of the random forest.
+		double ph = 7.4; //!< pH value used to ionize ligands.
+	};
+
+	//! Parses a receptor from a stream of pdbqt format and trains the random forest if requested, reporting progress to log. The scoring function is precalculated on demand as ligands are prepared.
+	explicit engine(istream& receptor_pdbqt, const settings& config, ostream& log);
+
+	engine(const engine&) = delete;
+	engine& operator=(const engine&) = delete;
+
+	//! Precalculates the scoring function of the atom types of a ligand, and creates their grid maps, either being mapped from the cache if present. Ligands prepared already may be docked meanwhile. Returns false if the scoring function or grid map cache cannot be written.
+	bool prepare(const ligand& lig, stage_times& times, event_counts& events);
+
+	//! Docks a prepared ligand with the configured number of Monte Carlo tasks, task i being seeded by splitmix64(key, i), and returns the clustered results, best first, which are yet to be finished.
+	vector<result> dock(const ligand& lig, const uint64_t key, stage_times& times, event_counts& events);
+
+	//! Adjusts the free energy of docked results relative to the best result and the ligand flexibility, and completes them with RF-Score and per residue contributions, marking contributing residues in mask.
+	void finish(const ligand& lig, vector<result>& results, vector<bool>& mask, stage_times& times) const;
+
+	//! Scores the input conformation of a prepared ligand at origin, precisely without grid maps if precise is true, and marks contributing residues in mask.
+	result score(const ligand& lig, const array<double, 3>& origin, const bool precise, vector<bool>& mask, stage_times& times) const;
+
+	//! Parses a ligand from a buffer of pdbqt format, docks it with seeds derived from the global seed and the buffer content so that the same ligand is always docked the same way, and writes its conformations to os in pdbqt format. Returns the finished results, best first. Failing to write the cache is not an error here.
+	vector<result> dock(const string& ligand_pdbqt, ostream& os);
+
+	//! Parses a ligand from a buffer of pdbqt format and scores its input conformation, precisely if grid maps are not used.
+	result score(const string& ligand_pdbqt);
+
+	const settings config; //!< Settings of the engine.
+	task_scheduler scheduler; //!< Scheduler to run Monte Carlo tasks and grid map tiles.
+	scoring_function sf; //!< Scoring function, precalculated on demand for the atom types of prepared ligands.
+	forest f; //!< Random forest, trained only if RF-Score is requested.
+	receptor rec; //!< Receptor whose grid maps are created on demand.
+	stage_times times; //!< Times of the stages run once per engine, and of the ligands docked or scored from buffers.
+	event_counts events; //!< Events of the ligands docked or scored from buffers.
+private:
+	mutex maps_mutex; //!< Mutex serializing the creation of grid maps.
+};
+
+#endif
@@ -0,0 +1,46 @@
+#include "events.hpp"
+
+const array<string, num_events> event_counts::names
+{{
+	"evaluations",
+	"rejections_out_of_box",
+	"rejections_over_bound",
+	"monte_carlo_steps",
+	"metropolis_acceptances",
+	"bfgs_iterations",
+	"failed_line_searches",
+	"result_pushes",
+	"result_replacements",
+	"map_probes_populated",
+}};
+
+event_counts::event_counts()
+{
+	for (auto& c : *this)
+	{
+		c = 0;
+	}
+}
+
+event_counts& event_counts::operator+=(const event_counts& other)
+{
+	for (size_t e = 0; e < num_events; ++e)
+	{
+		(*this)[e] += other[e];
+	}
+	return *this;
+}
+
+event_scope::event_scope(event_counts& counts) : counts(counts), outer(thread_events)
+{
+	thread_events.fill(0);
+}
+
+event_scope::~event_scope()
+{
+	for (size_t e = 0; e < num_events; ++e)
+	{
+		counts[e] += thread_events[e];
+	}
+	thread_events = outer;
+}
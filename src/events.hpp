@@ -0,0 +1,60 @@
+#pragma once
+#ifndef IDOCK_EVENTS_HPP
+#define IDOCK_EVENTS_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+using namespace std;
+
+//! Events counted on hot paths.
+enum event : size_t
+{
+	evaluations, //!< Calls to ligand::evaluate.
+	rejections_out_of_box, //!< Evaluations rejected because an atom or a frame origin is out of the box.
+	rejections_over_bound, //!< Evaluations rejected because the free energy is not below the upper bound.
+	monte_carlo_steps, //!< Monte Carlo iterations, each mutating and locally optimizing a conformation.
+	metropolis_acceptances, //!< Monte Carlo iterations whose optimized conformation is accepted by the Metropolis criterion.
+	bfgs_iterations, //!< BFGS iterations that found a step length and updated the Hessian.
+	failed_line_searches, //!< Line searches that found no step length satisfying the Wolfe conditions, ending a local optimization.
+	result_pushes, //!< Calls to result::push.
+	result_replacements, //!< Pushed results that replaced a result already in the container.
+	map_probes_populated, //!< Probes of grid maps populated, counted once per atom type.
+	num_events
+};
+
+//! Counts of events of the calling thread. They are plain integers so that hot paths count without atomics or locks, and are collected by event scopes.
+inline thread_local array<uint64_t, num_events> thread_events{};
+
+//! Represents counts of events aggregated across threads.
+class event_counts : public array<atomic<uint64_t>, num_events>
+{
+public:
+	static const array<string, num_events> names; //!< Names of events, used as keys.
+
+	//! Constructs zero counts for all the events.
+	explicit event_counts();
+
+	//! Adds the counts of another set of events.
+	event_counts& operator+=(const event_counts& other);
+};
+
+//! Collects the events counted by the calling thread while in scope into event counts on destruction. Events of nested scopes, e.g. of tasks run while waiting for a task group, are collected by those scopes only.
+class event_scope
+{
+public:
+	//! Starts collecting events of the calling thread into counts.
+	explicit event_scope(event_counts& counts);
+
+	//! Adds the events counted in scope to the counts, and restores the counts of the enclosing scope.
+	~event_scope();
+
+	event_scope(const event_scope&) = delete;
+	event_scope& operator=(const event_scope&) = delete;
+private:
+	event_counts& counts; //!< Counts to collect events into.
+	array<uint64_t, num_events> outer; //!< Counts of the enclosing scope.
+};
+
+#endif
@@ -0,0 +1,45 @@
+#pragma once
+#ifndef IDOCK_HASH_HPP
+#define IDOCK_HASH_HPP
+
+#include <cstdint>
+#include <string>
+using namespace std;
+
+//! Offset basis of the 64-bit FNV-1a hash.
+const uint64_t fnv1a_basis = 0xcbf29ce484222325ULL;
+
+//! Accumulates a byte sequence into a 64-bit FNV-1a hash. The result is stable across platforms and runs.
+inline uint64_t fnv1a(const void* data, const size_t size, uint64_t h = fnv1a_basis)
+{
+	const auto bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; ++i)
+	{
+		h ^= bytes[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+//! Accumulates a string into a 64-bit FNV-1a hash.
+inline uint64_t fnv1a(const string& str, const uint64_t h = fnv1a_basis)
+{
+	return fnv1a(str.data(), str.size(), h);
+}
+
+//! Mixes a 64-bit counter with the SplitMix64 generator, so that consecutive counters give uncorrelated outputs. The result is stable across platforms and runs.
+inline uint64_t splitmix64(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+//! Returns the k-th output of a SplitMix64 stream keyed by key. Being counter-based, any output can be generated independently of the others.
+inline uint64_t splitmix64(const uint64_t key, const uint64_t k)
+{
+	return splitmix64(key + k * 0x9e3779b97f4a7c15ULL);
+}
+
+#endif
@@ -2,13 +2,21 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <memory>
 #include <cassert>
+#include <algorithm>
 #include "matrix.hpp"
 #include "array.hpp"
 #include "ligand.hpp"
 #include "string.hpp"
+#include "events.hpp"
 
 ligand::ligand(const path& p, array<double, 3>& origin, const pka& pka, double ph)
+	: ligand(*make_unique<ifstream>(p), origin, pka, ph)
+{
+}
+
+ligand::ligand(istream& is, array<double, 3>& origin, const pka& pka, double ph)
 	: xs{}
 	, num_active_torsions(0)
 {
@@ -41,7 +49,7 @@ ligand::ligand(const path& p, array<double, 3>& origin, const pka& pka, double p
 	//   -r APOLAR          remove non-polar hydrogens.
 	//   -j FLEX            output as a flexible molecule with branches.
 	//   -w                 remove water.
-	for (ifstream ifs(p); safe_getline(ifs, line);)
+	while (safe_getline(is, line))
 	{
 		const string record = line.substr(0, 6);
 		if (record == "ATOM  " || record == "HETATM")
@@ -224,6 +232,17 @@ ligand::ligand(const path& p, array<double, 3>& origin, const pka& pka, double p
 	flexibility_penalty_factor = 1 / (1 + 0.05846 * (num_active_torsions + 0.5 * (num_torsions - num_active_torsions)));
 	assert(flexibility_penalty_factor <= 1);
 
+	// Determine the subtree of every frame and the frames of active torsions.
+	// Frames are in depth-first order, so a subtree ends at the first frame whose parent precedes its root.
+	torsion_frames.reserve(num_active_torsions);
+	for (size_t k = 0; k < num_frames; ++k)
+	{
+		frame& f = frames[k];
+		for (f.fend = k + 1; f.fend < num_frames && frames[f.fend].parent >= k; ++f.fend);
+		if (k && f.active) torsion_frames.push_back(k);
+	}
+	assert(torsion_frames.size() == num_active_torsions);
+
 	// Detect the presence of XScore atom types.
 	for (const auto& a : heavy_atoms)
 	{
@@ -247,6 +266,21 @@ ligand::ligand(const path& p, array<double, 3>& origin, const pka& pka, double p
 		}
 	}
 
+	// Pack the relative heavy atom coordinates and XScore types for evaluation.
+	heavy_xs.resize(num_heavy_atoms);
+	for (size_t j = 0; j < 3; ++j)
+	{
+		heavy_coor[j].resize(num_heavy_atoms);
+	}
+	for (size_t i = 0; i < num_heavy_atoms; ++i)
+	{
+		const atom& a = heavy_atoms[i];
+		heavy_coor[0][i] = a.coord[0];
+		heavy_coor[1][i] = a.coord[1];
+		heavy_coor[2][i] = a.coord[2];
+		heavy_xs[i] = a.xs;
+	}
+
 	// Find intra-ligand interacting pairs that are not 1-4.
 	interacting_pairs.reserve(num_heavy_atoms * num_heavy_atoms);
 	vector<size_t> neighbors;
@@ -301,6 +335,41 @@ ligand::ligand(const path& p, array<double, 3>& origin, const pka& pka, double p
 			neighbors.clear();
 		}
 	}
+
+	// Classify the interacting pairs by the subtree of every active torsion. Frames are in depth-first order, so the heavy atoms of a subtree are contiguous.
+	vector<size_t> atom_frames(num_heavy_atoms);
+	for (size_t k = 0; k < num_frames; ++k)
+	{
+		fill(atom_frames.begin() + frames[k].habegin, atom_frames.begin() + frames[k].haend, k);
+	}
+	subtrees.resize(num_active_torsions);
+	for (size_t t = 0; t < num_active_torsions; ++t)
+	{
+		subtree& s = subtrees[t];
+		s.k0 = torsion_frames[t];
+		s.k1 = frames[s.k0].fend;
+		s.a0 = frames[s.k0].habegin;
+		s.a1 = frames[s.k1 - 1].haend;
+		for (size_t j = 0; j < interacting_pairs.size(); ++j)
+		{
+			const auto& p = interacting_pairs[j];
+			const bool in0 = s.a0 <= p.i0 && p.i0 < s.a1;
+			const bool in1 = s.a0 <= p.i1 && p.i1 < s.a1;
+			if (in0 && in1)
+			{
+				s.inner_pairs.push_back(j);
+			}
+			else if (in0 || in1)
+			{
+				s.crossing_pairs.push_back(j);
+				const size_t k = atom_frames[in0 ? p.i1 : p.i0];
+				if (find(s.partner_frames.cbegin(), s.partner_frames.cend(), k) == s.partner_frames.cend())
+				{
+					s.partner_frames.push_back(k);
+				}
+			}
+		}
+	}
 }
 
 // This function does not require receptor::use_maps.
@@ -351,13 +420,16 @@ result ligand::complete_result_noconf(const array<double, 3>& origin, const scor
 	vector<double> e_heavy_atoms(num_heavy_atoms);
 
 	// Calculate inter-ligand free energy.
+	vector<size_t> indices;
 	for (size_t i = 0; i < num_heavy_atoms; ++i)
 	{
 		const size_t xs = this->heavy_atoms[i].xs;
 		const auto& coord = heavy_atoms[i];
 
-		for (const auto& a : rec.atoms)
+		rec.atoms_near(coord, coord, scoring_function::cutoff, indices);
+		for (const size_t idx : indices)
 		{
+			const auto& a = rec.atoms[idx];
 			const double r2 = norm_sqr(coord - a.coord);
 			if (r2 < scoring_function::cutoff_sqr)
 			{
@@ -398,38 +470,76 @@ result ligand::complete_result_noconf(const array<double, 3>& origin, const scor
 	return result(e, f, false, move(heavy_atoms), move(hydrogens), move(e_heavy_atoms), move(e_residues));
 }
 
-bool ligand::evaluate(const conformation& conf, const scoring_function& sf, const receptor& rec, const double e_upper_bound, double& e, double& f, change& g) const
+double ligand::estimate_cost(const path& p)
 {
-	assert(rec.use_maps);
-	if (!rec.within(conf.position))
-		return false;
+	// Count active torsions by the rule of the parser. A branch is dropped if it has no heavy atoms, and its torsion is inactive if it has no nonempty subbranches and a single heavy atom, e.g. -OH and -NH2.
+	size_t num_heavy_atoms = 0, num_torsions = 0;
+	vector<pair<size_t, bool>> branches; // Number of heavy atoms preceding every open branch, and whether it has a nonempty subbranch.
+	string line;
+	for (ifstream ifs(p); safe_getline(ifs, line);)
+	{
+		const string record = line.substr(0, 6);
+		if (record == "ATOM  " || record == "HETATM")
+		{
+			if (!atom(line).is_hydrogen()) ++num_heavy_atoms;
+		}
+		else if (record == "BRANCH")
+		{
+			branches.emplace_back(num_heavy_atoms, false);
+		}
+		else if (record == "ENDBRA" && !branches.empty())
+		{
+			const auto b = branches.back();
+			branches.pop_back();
+			if (b.first == num_heavy_atoms) continue;
+			if (b.second || b.first + 1 < num_heavy_atoms) ++num_torsions;
+			if (!branches.empty()) branches.back().second = true;
+		}
+	}
 
-	// Initialize frame-wide conformational variables.
-	vector<array<double, 3>> orig(num_frames); //!< Origin coordinate, which is rotorY.
-	vector<array<double, 3>> axes(num_frames); //!< Vector pointing from rotor Y to rotor X.
-	vector<array<double, 4>> oriq(num_frames); //!< Orientation in the form of quaternion.
-	vector<array<double, 9>> orim(num_frames); //!< Orientation in the form of 3x3 matrix.
-	vector<array<double, 3>> forc(num_frames); //!< Aggregated derivatives of heavy atoms.
-	vector<array<double, 3>> torq(num_frames); //!< Torque of the force.
+	// A Monte Carlo task runs 100 iterations per heavy atom, each of which takes a number of BFGS steps growing with the degrees of freedom, and each step evaluates heavy atoms and their intra-ligand pairs.
+	const double n = static_cast<double>(num_heavy_atoms);
+	return n * (6 + num_torsions) * n * n;
+}
 
-	// Initialize atom-wide conformational variables.
-	vector<array<double, 3>> coor(num_heavy_atoms); //!< Heavy atom coordinates.
-	vector<array<double, 3>> deri(num_heavy_atoms); //!< Heavy atom derivatives.
+workspace ligand::create_workspace() const
+{
+	return workspace(num_frames, num_heavy_atoms, interacting_pairs.size());
+}
 
-	// Apply position and orientation to ROOT frame.
-	const frame& root = frames.front();
-	orig.front() = conf.position;
-	oriq.front() = conf.orientation;
-	orim.front() = qtn4_to_mat3(conf.orientation);
-	for (size_t i = root.habegin; i < root.haend; ++i)
+bool ligand::transform(const size_t beg, const size_t end, const array<double, 3>& o, const array<double, 9>& m, const receptor& rec, workspace& w) const
+{
+	const double* const lx = heavy_coor[0].data();
+	const double* const ly = heavy_coor[1].data();
+	const double* const lz = heavy_coor[2].data();
+	double* const cx = w.coor[0].data();
+	double* const cy = w.coor[1].data();
+	double* const cz = w.coor[2].data();
+	const array<double, 3>& c0 = rec.corner0;
+	const array<double, 3>& c1 = rec.corner1;
+
+	// The loop is free of branches so that it can be vectorized.
+	bool within = true;
+	for (size_t i = beg; i < end; ++i)
 	{
-		coor[i] = orig.front() + orim.front() * heavy_atoms[i].coord;
-		if (!rec.within(coor[i]))
-			return false;
+		const double x = o[0] + (m[0] * lx[i] + m[1] * ly[i] + m[2] * lz[i]);
+		const double y = o[1] + (m[3] * lx[i] + m[4] * ly[i] + m[5] * lz[i]);
+		const double z = o[2] + (m[6] * lx[i] + m[7] * ly[i] + m[8] * lz[i]);
+		cx[i] = x;
+		cy[i] = y;
+		cz[i] = z;
+		within &= (c0[0] <= x) & (x < c1[0]) & (c0[1] <= y) & (y < c1[1]) & (c0[2] <= z) & (z < c1[2]);
 	}
+	return within;
+}
 
-	// Apply torsions to BRANCH frames.
-	for (size_t k = 1, t = 0; k < num_frames; ++k)
+bool ligand::apply_torsions(const conformation& conf, const size_t k0, const size_t k1, size_t t, const receptor& rec, workspace& w) const
+{
+	auto& orig = w.orig;
+	auto& axes = w.axes;
+	auto& oriq = w.oriq;
+	auto& orim = w.orim;
+	for (size_t k = k0; k < k1; ++k)
 	{
 		const frame& f = frames[k];
 
@@ -443,7 +553,9 @@ bool ligand::evaluate(const conformation& conf, const scoring_function& sf, cons
 		{
 			assert(f.habegin + 1 == f.haend);
 			assert(f.habegin == f.rotorYidx);
-			coor[f.rotorYidx] = orig[k];
+			w.coor[0][f.rotorYidx] = orig[k][0];
+			w.coor[1][f.rotorYidx] = orig[k][1];
+			w.coor[2][f.rotorYidx] = orig[k][2];
 			continue;
 		}
 
@@ -456,45 +568,55 @@ bool ligand::evaluate(const conformation& conf, const scoring_function& sf, cons
 		orim[k] = qtn4_to_mat3(oriq[k]);
 
 		// Update coordinates.
-		for (size_t i = f.habegin; i < f.haend; ++i)
-		{
-			coor[i] = orig[k] + orim[k] * heavy_atoms[i].coord;
-			if (!rec.within(coor[i]))
-				return false;
-		}
+		if (!transform(f.habegin, f.haend, orig[k], orim[k], rec, w))
+			return false;
 	}
+	return true;
+}
 
-	// Check steric clash between atoms of different frames except for (rotorX, rotorY) pair.
-	//for (size_t k1 = num_frames - 1; k1 > 0; --k1)
-	//{
-	//	const frame& f1 = frames[k1];
-	//	for (size_t i1 = f1.habegin; i1 < f1.haend; ++i1)
-	//	{
-	//		for (size_t k2 = 0; k2 < k1; ++k2)
-	//		{
-	//			const frame& f2 = frames[k2];
-	//			for (size_t i2 = f2.habegin; i2 < f2.haend; ++i2)
-	//			{
-	//				if ((distance_sqr(coor[i1], coor[i2]) < sqr(heavy_atoms[i1].covalent_radius() + heavy_atoms[i2].covalent_radius())) && (!((k2 == f1.parent) && (i1 == f1.rotorYidx) && (i2 == f1.rotorXidx))))
-	//					return false;
-	//			}
-	//		}
-	//	}
-	//}
-
-	e = 0;
-	for (size_t i = 0; i < num_heavy_atoms; ++i)
+void ligand::read_maps(const size_t beg, const size_t end, const receptor& rec, workspace& w) const
+{
+	const double* const cx = w.coor[0].data();
+	const double* const cy = w.coor[1].data();
+	const double* const cz = w.coor[2].data();
+	double* const ae = w.atom_e.data();
+	double* const ax = w.atom_d[0].data();
+	double* const ay = w.atom_d[1].data();
+	double* const az = w.atom_d[2].data();
+	for (size_t i = beg; i < end; ++i)
 	{
-		const size_t xs = heavy_atoms[i].xs;
+		const size_t xs = heavy_xs[i];
+
+		// Interpolate the energy and its gradient from the 8 corners of the partition if requested.
+		if (rec.trilinear)
+		{
+			array<double, 3> d;
+			ae[i] = rec.e(xs, array<double, 3>{{ cx[i], cy[i], cz[i] }}, d);
+			ax[i] = d[0];
+			ay[i] = d[1];
+			az[i] = d[2];
+			continue;
+		}
 
 		// Find the index and fraction of the current coor.
-		const auto index = rec.index(coor[i]);
+		const auto index = rec.index(array<double, 3>{{ cx[i], cy[i], cz[i] }});
 
 		// Assert the validity of index.
 		assert(index[0] + 1 < rec.num_probes[0]);
 		assert(index[1] + 1 < rec.num_probes[1]);
 		assert(index[2] + 1 < rec.num_probes[2]);
 
+		// Read the energy and its precalculated derivatives from a single record if available.
+		if (rec.gradient_maps)
+		{
+			const fl* const r = rec.g(xs, index);
+			ae[i] = r[0];
+			ax[i] = r[1];
+			ay[i] = r[2];
+			az[i] = r[3];
+			continue;
+		}
+
 		// (x0, y0, z0) is the beginning corner of the partition.
 		const size_t x0 = index[0];
 		const size_t y0 = index[1];
@@ -505,51 +627,59 @@ bool ligand::evaluate(const conformation& conf, const scoring_function& sf, cons
 		const double e100 = rec.e(xs, array<size_t, 3>{{x0 + 1, y0    , z0    }});
 		const double e010 = rec.e(xs, array<size_t, 3>{{x0    , y0 + 1, z0    }});
 		const double e001 = rec.e(xs, array<size_t, 3>{{x0    , y0    , z0 + 1}});
-		deri[i][0] = (e100 - e000) * rec.granularity_inverse;
-		deri[i][1] = (e010 - e000) * rec.granularity_inverse;
-		deri[i][2] = (e001 - e000) * rec.granularity_inverse;
-
-		e += e000; // Aggregate the energy.
+		ae[i] = e000;
+		ax[i] = (e100 - e000) * rec.granularity_inverse;
+		ay[i] = (e010 - e000) * rec.granularity_inverse;
+		az[i] = (e001 - e000) * rec.granularity_inverse;
 	}
+}
 
-	// Save inter-molecular free energy into f.
-	f = e;
-
-	// Calculate intra-ligand free energy.
-	for (const auto &p : interacting_pairs)
+void ligand::aggregate(const size_t k, workspace& w) const
+{
+	const frame& f = frames[k];
+	const array<double, 3>& o = w.orig[k];
+	const double* const cx = w.coor[0].data();
+	const double* const cy = w.coor[1].data();
+	const double* const cz = w.coor[2].data();
+	const double* const dx = w.deri[0].data();
+	const double* const dy = w.deri[1].data();
+	const double* const dz = w.deri[2].data();
+	double fx = 0, fy = 0, fz = 0;
+	double tx = 0, ty = 0, tz = 0;
+	for (size_t i = f.habegin; i < f.haend; ++i)
 	{
-		const array<double, 3> r = coor[p.i1] - coor[p.i0];
-		const double r2 = norm_sqr(r);
-		if (r2 < scoring_function::cutoff_sqr)
-		{
-			const size_t nsr2 = static_cast<size_t>(sf.ns * r2);
-			e += sf.e[p.p_offset][nsr2];
-			const array<double, 3> d = sf.d[p.p_offset][nsr2] * r;
-			deri[p.i0] -= d;
-			deri[p.i1] += d;
-		}
+		const double rx = cx[i] - o[0];
+		const double ry = cy[i] - o[1];
+		const double rz = cz[i] - o[2];
+		fx += dx[i];
+		fy += dy[i];
+		fz += dz[i];
+		tx += ry * dz[i] - rz * dy[i];
+		ty += rz * dx[i] - rx * dz[i];
+		tz += rx * dy[i] - ry * dx[i];
 	}
+	w.own_forc[k] = {{ fx, fy, fz }};
+	w.own_torq[k] = {{ tx, ty, tz }};
+}
 
-	// If the free energy is no better than the upper bound, refuse this conformation.
-	if (e >= e_upper_bound) return false;
+void ligand::propagate(change& g, workspace& w) const
+{
+	auto& orig = w.orig;
+	auto& forc = w.forc;
+	auto& torq = w.torq;
+	copy(w.own_forc.cbegin(), w.own_forc.cend(), forc.begin());
+	copy(w.own_torq.cbegin(), w.own_torq.cend(), torq.begin());
 
 	// Calculate and aggregate the force and torque of BRANCH frames to their parent frame.
 	for (size_t k = num_frames - 1, t = 6 + num_active_torsions; k > 0; --k)
 	{
 		const frame& f = frames[k];
 
-		for (size_t i = f.habegin; i < f.haend; ++i)
-		{
-			// The deri with respect to the position, orientation, and torsions
-			// would be the negative total force acting on the ligand,
-			// the negative total torque, and the negative torque projections, respectively,
-			// where the projections refer to the torque applied to the branch moved by the torsion,
-			// projected on its rotation axis.
-			forc[k] += deri[i];
-			torq[k] += cross(coor[i] - orig[k], deri[i]);
-		}
-
-		// Aggregate the force and torque of current frame to its parent frame.
+		// The deri with respect to the position, orientation, and torsions
+		// would be the negative total force acting on the ligand,
+		// the negative total torque, and the negative torque projections, respectively,
+		// where the projections refer to the torque applied to the branch moved by the torsion,
+		// projected on its rotation axis.
 		forc[f.parent] += forc[k];
 		torq[f.parent] += torq[k] + cross(orig[k] - orig[f.parent], forc[k]);
 
@@ -557,32 +687,304 @@ bool ligand::evaluate(const conformation& conf, const scoring_function& sf, cons
 		if (!f.active) continue;
 
 		// Save the torsion.
-		g[--t] = torq[k] * axes[k]; // dot product
+		g[--t] = torq[k] * w.axes[k]; // dot product
 	}
 
-	// Calculate and aggregate the force and torque of ROOT frame.
-	for (size_t i = root.habegin; i < root.haend; ++i)
-	{
-		forc.front() += deri[i];
-		torq.front() += cross(coor[i] - orig.front(), deri[i]);
-	}
-
-	// Save the aggregated force and torque to g.
+	// Save the aggregated force and torque of ROOT frame to g.
 	g[0] = forc.front()[0];
 	g[1] = forc.front()[1];
 	g[2] = forc.front()[2];
 	g[3] = torq.front()[0];
 	g[4] = torq.front()[1];
 	g[5] = torq.front()[2];
+}
+
+bool ligand::evaluate(const conformation& conf, const scoring_function& sf, const receptor& rec, const double e_upper_bound, double& e, double& f, change& g, workspace& w) const
+{
+	assert(rec.use_maps);
+	++thread_events[evaluations];
+	if (!rec.within(conf.position))
+	{
+		++thread_events[rejections_out_of_box];
+		return false;
+	}
+
+	// Bind atom-wide conformational variables to the workspace.
+	assert(w.orig.size() == num_frames);
+	assert(w.coor[0].size() == num_heavy_atoms);
+	const double* const cx = w.coor[0].data();
+	const double* const cy = w.coor[1].data();
+	const double* const cz = w.coor[2].data();
+	double* const dx = w.deri[0].data();
+	double* const dy = w.deri[1].data();
+	double* const dz = w.deri[2].data();
+	const double* const ae = w.atom_e.data();
+	const double* const ax = w.atom_d[0].data();
+	const double* const ay = w.atom_d[1].data();
+	const double* const az = w.atom_d[2].data();
+	double* const pe = w.pair_e.data();
+	double* const pd = w.pair_d.data();
+
+	// Apply position and orientation to ROOT frame, and torsions to BRANCH frames.
+	const frame& root = frames.front();
+	w.orig.front() = conf.position;
+	w.oriq.front() = conf.orientation;
+	w.orim.front() = qtn4_to_mat3(conf.orientation);
+	if (!transform(root.habegin, root.haend, w.orig.front(), w.orim.front(), rec, w) || !apply_torsions(conf, 1, num_frames, 0, rec, w))
+	{
+		++thread_events[rejections_out_of_box];
+		return false;
+	}
+
+	// Check steric clash between atoms of different frames except for (rotorX, rotorY) pair.
+	//for (size_t k1 = num_frames - 1; k1 > 0; --k1)
+	//{
+	//	const frame& f1 = frames[k1];
+	//	for (size_t i1 = f1.habegin; i1 < f1.haend; ++i1)
+	//	{
+	//		for (size_t k2 = 0; k2 < k1; ++k2)
+	//		{
+	//			const frame& f2 = frames[k2];
+	//			for (size_t i2 = f2.habegin; i2 < f2.haend; ++i2)
+	//			{
+	//				if ((distance_sqr(coor[i1], coor[i2]) < sqr(heavy_atoms[i1].covalent_radius() + heavy_atoms[i2].covalent_radius())) && (!((k2 == f1.parent) && (i1 == f1.rotorYidx) && (i2 == f1.rotorXidx))))
+	//					return false;
+	//			}
+	//		}
+	//	}
+	//}
+
+	// Read the inter-molecular free energy and its derivatives of heavy atoms from grid maps.
+	read_maps(0, num_heavy_atoms, rec, w);
+
+	// Aggregate the inter-molecular free energy and save it into f.
+	e = 0;
+	for (size_t i = 0; i < num_heavy_atoms; ++i)
+	{
+		e += ae[i];
+		dx[i] = ax[i];
+		dy[i] = ay[i];
+		dz[i] = az[i];
+	}
+	f = e;
+
+	// Calculate intra-ligand free energy. Pairs beyond cutoff are saved as 0, so that a torsion mutation can subtract them unconditionally.
+	double intra = 0;
+	for (size_t j = 0; j < interacting_pairs.size(); ++j)
+	{
+		const auto& p = interacting_pairs[j];
+		const double rx = cx[p.i1] - cx[p.i0];
+		const double ry = cy[p.i1] - cy[p.i0];
+		const double rz = cz[p.i1] - cz[p.i0];
+		const double r2 = rx * rx + ry * ry + rz * rz;
+		if (r2 < scoring_function::cutoff_sqr)
+		{
+			const size_t nsr2 = static_cast<size_t>(sf.ns * r2);
+			const double d = pd[j] = sf.d[p.p_offset][nsr2];
+			intra += pe[j] = sf.e[p.p_offset][nsr2];
+			dx[p.i0] -= d * rx;
+			dy[p.i0] -= d * ry;
+			dz[p.i0] -= d * rz;
+			dx[p.i1] += d * rx;
+			dy[p.i1] += d * ry;
+			dz[p.i1] += d * rz;
+		}
+		else
+		{
+			pe[j] = pd[j] = 0;
+		}
+	}
+	e += intra;
+	w.inter_e = f;
+	w.intra_e = intra;
+
+	// If the free energy is no better than the upper bound, refuse this conformation.
+	if (e >= e_upper_bound)
+	{
+		++thread_events[rejections_over_bound];
+		return false;
+	}
 
+	// Calculate the force and torque of every frame, and aggregate them to the ROOT frame.
+	for (size_t k = 0; k < num_frames; ++k)
+	{
+		aggregate(k, w);
+	}
+	propagate(g, w);
 	return true;
 }
 
-result ligand::compose_result(const double e, const double f, const conformation& conf, bool from_docking) const
+bool ligand::evaluate(const conformation& conf, const scoring_function& sf, const receptor& rec, const double e_upper_bound, double& e, double& f, change& g, workspace& w, const workspace& w0, const size_t t) const
 {
-	vector<array<double, 3>> orig(num_frames);
-	vector<array<double, 4>> oriq(num_frames);
-	vector<array<double, 9>> orim(num_frames);
+	assert(rec.use_maps);
+	assert(t < num_active_torsions);
+	++thread_events[evaluations];
+	const subtree& s = subtrees[t];
+
+	// Apply torsions to the moved subtree, whose parent frame is in place already.
+	if (!apply_torsions(conf, s.k0, s.k1, t, rec, w))
+	{
+		++thread_events[rejections_out_of_box];
+		return false;
+	}
+
+	// Bind atom-wide conformational variables to the workspace.
+	const double* const cx = w.coor[0].data();
+	const double* const cy = w.coor[1].data();
+	const double* const cz = w.coor[2].data();
+	const double* const c0x = w0.coor[0].data();
+	const double* const c0y = w0.coor[1].data();
+	const double* const c0z = w0.coor[2].data();
+	double* const dx = w.deri[0].data();
+	double* const dy = w.deri[1].data();
+	double* const dz = w.deri[2].data();
+	const double* const ae = w.atom_e.data();
+	const double* const ax = w.atom_d[0].data();
+	const double* const ay = w.atom_d[1].data();
+	const double* const az = w.atom_d[2].data();
+	double* const pe = w.pair_e.data();
+	double* const pd = w.pair_d.data();
+
+	// Read the moved heavy atoms from grid maps, and add the change of their inter-molecular free energy to that of w0.
+	read_maps(s.a0, s.a1, rec, w);
+	f = w0.inter_e;
+	for (size_t i = s.a0; i < s.a1; ++i)
+	{
+		f += ae[i] - w0.atom_e[i];
+		dx[i] = ax[i];
+		dy[i] = ay[i];
+		dz[i] = az[i];
+	}
+
+	// Only the pairs crossing the subtree boundary change their distances. Their forces on the atoms outside are replaced, and those on the moved atoms are calculated afresh.
+	double intra = w0.intra_e;
+	for (const size_t j : s.crossing_pairs)
+	{
+		const auto& p = interacting_pairs[j];
+		const double d0 = w0.pair_d[j];
+		const double r0x = c0x[p.i1] - c0x[p.i0];
+		const double r0y = c0y[p.i1] - c0y[p.i0];
+		const double r0z = c0z[p.i1] - c0z[p.i0];
+		if (p.i0 < s.a0 || s.a1 <= p.i0)
+		{
+			dx[p.i0] += d0 * r0x;
+			dy[p.i0] += d0 * r0y;
+			dz[p.i0] += d0 * r0z;
+		}
+		else
+		{
+			dx[p.i1] -= d0 * r0x;
+			dy[p.i1] -= d0 * r0y;
+			dz[p.i1] -= d0 * r0z;
+		}
+		intra -= w0.pair_e[j];
+
+		const double rx = cx[p.i1] - cx[p.i0];
+		const double ry = cy[p.i1] - cy[p.i0];
+		const double rz = cz[p.i1] - cz[p.i0];
+		const double r2 = rx * rx + ry * ry + rz * rz;
+		if (r2 < scoring_function::cutoff_sqr)
+		{
+			const size_t nsr2 = static_cast<size_t>(sf.ns * r2);
+			const double d = pd[j] = sf.d[p.p_offset][nsr2];
+			intra += pe[j] = sf.e[p.p_offset][nsr2];
+			dx[p.i0] -= d * rx;
+			dy[p.i0] -= d * ry;
+			dz[p.i0] -= d * rz;
+			dx[p.i1] += d * rx;
+			dy[p.i1] += d * ry;
+			dz[p.i1] += d * rz;
+		}
+		else
+		{
+			pe[j] = pd[j] = 0;
+		}
+	}
+	e = f + intra;
+
+	// If the free energy is no better than the upper bound, refuse this conformation.
+	if (e >= e_upper_bound)
+	{
+		++thread_events[rejections_over_bound];
+		return false;
+	}
+	w.inter_e = f;
+	w.intra_e = intra;
+
+	// Pairs within the subtree keep their distances and energies, but their forces turn with it.
+	for (const size_t j : s.inner_pairs)
+	{
+		const auto& p = interacting_pairs[j];
+		const double d = pd[j];
+		const double rx = cx[p.i1] - cx[p.i0];
+		const double ry = cy[p.i1] - cy[p.i0];
+		const double rz = cz[p.i1] - cz[p.i0];
+		dx[p.i0] -= d * rx;
+		dy[p.i0] -= d * ry;
+		dz[p.i0] -= d * rz;
+		dx[p.i1] += d * rx;
+		dy[p.i1] += d * ry;
+		dz[p.i1] += d * rz;
+	}
+
+	// Recalculate the own force and torque of the frames whose heavy atoms moved or changed derivatives, and reuse those of the other frames.
+	for (size_t k = s.k0; k < s.k1; ++k)
+	{
+		aggregate(k, w);
+	}
+	for (const size_t k : s.partner_frames)
+	{
+		aggregate(k, w);
+	}
+	propagate(g, w);
+	return true;
+}
+
+void ligand::restore(workspace& w, const workspace& w0, const size_t t) const
+{
+	const subtree& s = subtrees[t];
+	const auto restore_range = [](auto& v, const auto& v0, const size_t beg, const size_t end)
+	{
+		copy(v0.cbegin() + beg, v0.cbegin() + end, v.begin() + beg);
+	};
+	restore_range(w.orig, w0.orig, s.k0, s.k1);
+	restore_range(w.axes, w0.axes, s.k0, s.k1);
+	restore_range(w.oriq, w0.oriq, s.k0, s.k1);
+	restore_range(w.orim, w0.orim, s.k0, s.k1);
+	restore_range(w.own_forc, w0.own_forc, s.k0, s.k1);
+	restore_range(w.own_torq, w0.own_torq, s.k0, s.k1);
+	restore_range(w.atom_e, w0.atom_e, s.a0, s.a1);
+	for (size_t i = 0; i < 3; ++i)
+	{
+		restore_range(w.coor[i], w0.coor[i], s.a0, s.a1);
+		restore_range(w.deri[i], w0.deri[i], s.a0, s.a1);
+		restore_range(w.atom_d[i], w0.atom_d[i], s.a0, s.a1);
+	}
+	for (const size_t k : s.partner_frames)
+	{
+		restore_range(w.own_forc, w0.own_forc, k, k + 1);
+		restore_range(w.own_torq, w0.own_torq, k, k + 1);
+		for (size_t i = 0; i < 3; ++i)
+		{
+			restore_range(w.deri[i], w0.deri[i], frames[k].habegin, frames[k].haend);
+		}
+	}
+	for (const size_t j : s.crossing_pairs)
+	{
+		w.pair_e[j] = w0.pair_e[j];
+		w.pair_d[j] = w0.pair_d[j];
+	}
+	w.inter_e = w0.inter_e;
+	w.intra_e = w0.intra_e;
+}
+
+result ligand::compose_result(const double e, const double f, const conformation& conf, bool from_docking, workspace& w) const
+{
+	auto& orig = w.orig;
+	auto& oriq = w.oriq;
+	auto& orim = w.orim;
+
+	// The coordinates are owned by the result, so they are allocated here.
 	vector<array<double, 3>> heavy_atoms(num_heavy_atoms);
 	vector<array<double, 3>> hydrogens(num_hydrogens);
 
@@ -630,11 +1032,14 @@ result ligand::compose_result(const double e, const double f, const conformation
 double ligand::calculate_rf_score(const result& r, const receptor& rec, const forest& f) const
 {
 	array<double, tree::nv> x{};
+	vector<size_t> indices;
 	for (size_t i = 0; i < num_heavy_atoms; ++i)
 	{
 		const atom& la = heavy_atoms[i];
-		for (const atom& ra : rec.atoms)
+		rec.atoms_near(r.heavy_atoms[i], r.heavy_atoms[i], 12, indices);
+		for (const size_t idx : indices)
 		{
+			const atom& ra = rec.atoms[idx];
 			const auto ds = distance_sqr(r.heavy_atoms[i], ra.coord);
 			if (ds >= 144) continue; // RF-Score cutoff 12A
 			if (!la.rf_unsupported() && !ra.rf_unsupported())
@@ -653,12 +1058,17 @@ double ligand::calculate_rf_score(const result& r, const receptor& rec, const fo
 }
 
 void ligand::write_models(const path& output_ligand_path, const vector<result>& results, const receptor& rec) const
+{
+	// Dump binding conformations to the output ligand file.
+	ofstream ofs(output_ligand_path);
+	write_models(ofs, results, rec);
+}
+
+void ligand::write_models(ostream& ofs, const vector<result>& results, const receptor& rec) const
 {
 	const size_t num_results = results.size();
 	assert(num_results);
 
-	// Dump binding conformations to the output ligand file.
-	ofstream ofs(output_ligand_path);
 	ofs.setf(ios::fixed, ios::floatfield);
 	for (size_t k = 0; k < num_results; ++k)
 	{
@@ -712,6 +1122,7 @@ void ligand::calculate_by_comp(result& result, const scoring_function& sf, const
 	e_residues.resize(rec.residues.size());
 	e_heavy_atoms.resize(num_heavy_atoms);
 
+	vector<size_t> indices;
 	for (size_t k = 0; k < num_heavy_atoms; ++k)
 	{
 		const auto& coord = result.heavy_atoms[k];
@@ -722,8 +1133,10 @@ void ligand::calculate_by_comp(result& result, const scoring_function& sf, const
 		const auto coord_grid = rec.coord(index); // Aligned coordinate.
 
 		// Iterate through all atom ids contributing energy to the grid.
-		for (const auto& a : rec.atoms)
+		rec.atoms_near(coord_grid, coord_grid, scoring_function::cutoff, indices);
+		for (const size_t idx : indices)
 		{
+			const auto& a = rec.atoms[idx];
 			assert(!a.is_hydrogen());
 
 			auto r2 = distance_sqr(a.coord, coord_grid);
@@ -735,7 +1148,7 @@ void ligand::calculate_by_comp(result& result, const scoring_function& sf, const
 				size_t p = mp(a.xs, xs);
 				assert(p < sf.np);
 
-				assert(!sf.e[p].empty());
+				assert(sf.e[p]);
 				const double e0 = sf.e[p][r_offset]; // Read from template.
 
 				scoring_function::score(e_residues[a.residue].data(), a.xs, xs, r2);
@@ -756,7 +1169,7 @@ void ligand::calculate_by_comp(result& result, const scoring_function& sf, const
 	}
 }
 
-void ligand::monte_carlo(vector<result>& results, const size_t seed, const scoring_function& sf, const receptor& rec) const
+bool ligand::monte_carlo(vector<result>& results, const size_t seed, const scoring_function& sf, const receptor& rec, const chrono::steady_clock::time_point deadline) const
 {
 	// Define constants.
 	static const double pi = 3.1415926535897932; //!< Pi.
@@ -777,6 +1190,13 @@ void ligand::monte_carlo(vector<result>& results, const size_t seed, const scori
 	uniform_int_distribution<size_t> uen(0, num_entities - 1);
 	normal_distribution<double> n01(0, 1);
 
+	// Create workspaces for evaluations of this task.
+	// w0 holds the evaluated state of c0. wm mirrors w0 but for what the last torsion mutation wrote, so that a torsion mutation of c0 restores and recalculates its subtree only.
+	// w1 holds the evaluated state of c1, unless c1 is a torsion mutation yet to be minimized, whose state is in wm.
+	workspace w = create_workspace(), w0 = create_workspace(), w1 = create_workspace(), wm = create_workspace();
+	size_t wm_torsion = SIZE_MAX; // Torsion whose mutation wm was last evaluated for, or SIZE_MAX if wm no longer mirrors w0.
+	bool c1_in_wm;
+
 	// Generate an initial random conformation c0, and evaluate it.
 	conformation c0(num_active_torsions);
 	double e0, f0;
@@ -791,9 +1211,9 @@ void ligand::monte_carlo(vector<result>& results, const size_t seed, const scori
 		{
 			c0.torsions[i] = upi(rng);
 		}
-		valid_conformation = evaluate(c0, sf, rec, e_upper_bound, e0, f0, g0);
+		valid_conformation = evaluate(c0, sf, rec, e_upper_bound, e0, f0, g0, w0);
 	}
-	if (!valid_conformation) return;
+	if (!valid_conformation) return true;
 	double best_e = e0; // The best free energy so far.
 
 	// Initialize necessary variables for BFGS.
@@ -820,6 +1240,10 @@ void ligand::monte_carlo(vector<result>& results, const size_t seed, const scori
 
 	for (size_t mc_i = 0; mc_i < num_mc_iterations; ++mc_i)
 	{
+		// Stop cooperatively once the time budget of the ligand is spent, keeping the results found so far.
+		if (chrono::steady_clock::now() >= deadline) return false;
+		++thread_events[monte_carlo_steps];
+
 		size_t mutation_entity;
 
 		// Mutate c0 into c1, and evaluate c1.
@@ -844,7 +1268,20 @@ void ligand::monte_carlo(vector<result>& results, const size_t seed, const scori
 				c1.orientation = vec3_to_qtn4(0.01 * array<double, 3>{{u11(rng), u11(rng), u11(rng)}}) * c1.orientation;
 				assert(normalized(c1.orientation));
 			}
-		} while (!evaluate(c1, sf, rec, e_upper_bound, e1, f1, g1));
+			c1_in_wm = mutation_entity < num_active_torsions;
+			if (c1_in_wm)
+			{
+				if (wm_torsion == SIZE_MAX)
+				{
+					wm = w0;
+				}
+				else
+				{
+					restore(wm, w0, wm_torsion);
+				}
+				wm_torsion = mutation_entity;
+			}
+		} while (!(c1_in_wm ? evaluate(c1, sf, rec, e_upper_bound, e1, f1, g1, wm, w0, mutation_entity) : evaluate(c1, sf, rec, e_upper_bound, e1, f1, g1, w1)));
 
 		// Initialize the Hessian matrix to identity.
 		h = h1;
@@ -892,7 +1329,7 @@ void ligand::monte_carlo(vector<result>& results, const size_t seed, const scori
 				// Evaluate c2, subject to Wolfe conditions http://en.wikipedia.org/wiki/Wolfe_conditions
 				// 1) Armijo rule ensures that the step length alpha decreases f sufficiently.
 				// 2) The curvature condition ensures that the slope has been reduced sufficiently.
-				if (evaluate(c2, sf, rec, e1 + 0.0001 * alpha * pg1, e2, f2, g2))
+				if (evaluate(c2, sf, rec, e1 + 0.0001 * alpha * pg1, e2, f2, g2, w))
 				{
 					pg2 = 0;
 					for (size_t i = 0; i < num_variables; ++i)
@@ -903,7 +1340,12 @@ void ligand::monte_carlo(vector<result>& results, const size_t seed, const scori
 			}
 
 			// If an appropriate alpha cannot be found, exit the BFGS loop.
-			if (num_alpha_trials == num_alphas) break;
+			if (num_alpha_trials == num_alphas)
+			{
+				++thread_events[failed_line_searches];
+				break;
+			}
+			++thread_events[bfgs_iterations];
 
 			// Update Hessian matrix h.
 			for (size_t i = 0; i < num_variables; ++i) // Calculate y = g2 - g1.
@@ -929,28 +1371,34 @@ void ligand::monte_carlo(vector<result>& results, const size_t seed, const scori
 					h[mr(i, j)] += ryp * (mhy[i] * p[j] + mhy[j] * p[i]) + pco * p[i] * p[j];
 				}
 
-			// Move to the next iteration.
+			// Move to the next iteration. The last evaluation was of c2, so w holds its state.
 			c1 = c2;
 			e1 = e2;
 			f1 = f2;
 			g1 = g2;
+			swap(w1, w);
+			c1_in_wm = false;
 		}
 
 		// Accept c1 according to Metropolis criteria.
 		const double delta = e0 - e1;
 		if (delta > 0 || u01(rng) < exp(delta))
 		{
+			++thread_events[metropolis_acceptances];
 			// best_e is the best energy of all the conformations in the container.
 			// e1 will be saved if and only if it is even better than the best one.
 			if (e1 < best_e || results.size() < results.capacity())
 			{
-				result::push(results, compose_result(e1, f1, c1, true), required_square_error);
+				result::push(results, compose_result(e1, f1, c1, true, w), required_square_error);
 				if (e1 < best_e) best_e = e0;
 			}
 
-			// Save c1 into c0.
+			// Save c1 into c0. wm no longer mirrors w0 afterwards.
 			c0 = c1;
 			e0 = e1;
+			swap(w0, c1_in_wm ? wm : w1);
+			wm_torsion = SIZE_MAX;
 		}
 	}
+	return true;
 }
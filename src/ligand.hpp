@@ -2,6 +2,7 @@
 #ifndef IDOCK_LIGAND_HPP
 #define IDOCK_LIGAND_HPP
 
+#include <chrono>
 #include <filesystem>
 #include "scoring_function.hpp"
 #include "random_forest.hpp"
@@ -25,6 +26,7 @@ public:
 	size_t haend; //!< The exclusive ending index to the heavy atoms of the current frame.
 	size_t hybegin; //!< The inclusive beginning index to the hydrogen atoms of the current frame.
 	size_t hyend; //!< The exclusive ending index to the hydrogen atoms of the current frame.
+	size_t fend; //!< The exclusive ending index to the frames of the subtree rooted at the current frame.
 	bool active; //!< Indicates if the current frame is active.
 	array<double, 3> parent_rotorY_to_current_rotorY; //!< Vector pointing from the origin of parent frame to the origin of current frame.
 	array<double, 3> parent_rotorX_to_current_rotorY; //!< Normalized vector pointing from rotor X of parent frame to rotor Y of current frame.
@@ -40,6 +42,7 @@ public:
 		, haend()
 		, hybegin(hybegin)
 		, hyend()
+		, fend()
 		, active(true)
 		, parent_rotorY_to_current_rotorY{}
 		, parent_rotorX_to_current_rotorY{}
@@ -47,12 +50,59 @@ public:
 	}
 };
 
+//! Represents a scratch workspace for evaluating conformations of a ligand. It is created once per Monte Carlo task and reused across evaluations, so that the inner loop performs no heap allocation.
+class workspace
+{
+public:
+	vector<array<double, 3>> orig; //!< Origin coordinate, which is rotorY.
+	vector<array<double, 3>> axes; //!< Vector pointing from rotor Y to rotor X.
+	vector<array<double, 4>> oriq; //!< Orientation in the form of quaternion.
+	vector<array<double, 9>> orim; //!< Orientation in the form of 3x3 matrix.
+	vector<array<double, 3>> forc; //!< Aggregated derivatives of heavy atoms.
+	vector<array<double, 3>> torq; //!< Torque of the force.
+	vector<array<double, 3>> own_forc; //!< Derivatives of the heavy atoms of every frame alone, excluding its child frames.
+	vector<array<double, 3>> own_torq; //!< Torque of own_forc about the frame origin.
+	array<vector<double>, 3> coor; //!< Heavy atom coordinates, stored as structure of arrays.
+	array<vector<double>, 3> deri; //!< Heavy atom derivatives, stored as structure of arrays.
+	vector<double> atom_e; //!< Inter-molecular free energy of heavy atoms read from grid maps.
+	array<vector<double>, 3> atom_d; //!< Inter-molecular free energy derivatives of heavy atoms, stored as structure of arrays.
+	vector<double> pair_e; //!< Intra-ligand free energy of interacting pairs, or 0 beyond cutoff.
+	vector<double> pair_d; //!< Intra-ligand free energy derivatives divided by distance of interacting pairs, or 0 beyond cutoff.
+	double inter_e; //!< Inter-molecular free energy, i.e. the sum of atom_e.
+	double intra_e; //!< Intra-ligand free energy, i.e. the sum of pair_e.
+
+	//! Constructs a workspace for a ligand of the given numbers of frames, heavy atoms and interacting pairs.
+	explicit workspace(const size_t num_frames, const size_t num_heavy_atoms, const size_t num_interacting_pairs)
+		: orig(num_frames)
+		, axes(num_frames)
+		, oriq(num_frames)
+		, orim(num_frames)
+		, forc(num_frames)
+		, torq(num_frames)
+		, own_forc(num_frames)
+		, own_torq(num_frames)
+		, atom_e(num_heavy_atoms)
+		, pair_e(num_interacting_pairs)
+		, pair_d(num_interacting_pairs)
+		, inter_e(0)
+		, intra_e(0)
+	{
+		for (size_t i = 0; i < 3; ++i)
+		{
+			coor[i].resize(num_heavy_atoms);
+			deri[i].resize(num_heavy_atoms);
+			atom_d[i].resize(num_heavy_atoms);
+		}
+	}
+};
+
 //! Represents a ligand.
 class ligand
 {
 public:
 	array<bool, scoring_function::n> xs; //!< Presence of XScore atom types.
 	size_t num_heavy_atoms; //!< Number of heavy atoms.
+	vector<size_t> heavy_xs; //!< XScore types of heavy atoms.
 	size_t num_active_torsions; //!< Number of active torsions.
 	double flexibility_penalty_factor; //!< A value in (0, 1] to penalize ligand flexibility.
 
@@ -60,24 +110,44 @@ public:
 	//! @exception parsing_error Thrown when an atom type is not recognized or an empty branch is detected.
 	ligand(const path& p, array<double, 3>& origin, const pka& pka, double ph);
 
-	//! Evaluates free energy e, force f, and change g. Returns true if the conformation is accepted.
-	bool evaluate(const conformation& conf, const scoring_function& sf, const receptor& rec, const double e_upper_bound, double& e, double& f, change& g) const;
+	//! Constructs a ligand by parsing a stream of pdbqt format.
+	//! @exception parsing_error Thrown when an atom type is not recognized or an empty branch is detected.
+	ligand(istream& is, array<double, 3>& origin, const pka& pka, double ph);
+
+	//! Estimates the relative cost of docking the ligand in a file from a cheap scan of its heavy atoms and active torsions, without parsing it.
+	static double estimate_cost(const path& p);
+
+	//! Creates a workspace sized for evaluating conformations of this ligand.
+	workspace create_workspace() const;
+
+	//! Evaluates free energy e, force f, and change g, using w as scratch space. Returns true if the conformation is accepted.
+	bool evaluate(const conformation& conf, const scoring_function& sf, const receptor& rec, const double e_upper_bound, double& e, double& f, change& g, workspace& w) const;
+
+	//! Evaluates free energy e, force f, and change g of a conformation that differs only in torsion t from the accepted conformation evaluated into w0. w must equal w0, e.g. by restore(). Only the subtree moved by the torsion and the interacting pairs crossing its boundary are recalculated, and the energy, derivatives and frame forces of the rest are reused. Returns true if the conformation is accepted.
+	bool evaluate(const conformation& conf, const scoring_function& sf, const receptor& rec, const double e_upper_bound, double& e, double& f, change& g, workspace& w, const workspace& w0, const size_t t) const;
+
+	//! Copies from w0 into w the parts that evaluating a mutation of torsion t may have written, so that a w otherwise equal to w0 equals it again.
+	void restore(workspace& w, const workspace& w0, const size_t t) const;
 
 	//! Returns a result with free energy e and force f being per-residuely evaluated from the original ligand without a conformation. This is a short-circuited version indenpendent on receptor grid maps.
 	result complete_result_noconf(const array<double, 3>& origin, const scoring_function& sf, const receptor& rec, vector<bool>& mask) const;
 
-	//! Composes a partial result from free energy, inter-molecular free energy f, and conformation conf but without per residue contributions.
-	result compose_result(const double e, const double f, const conformation& conf, bool from_docking) const;
+	//! Composes a partial result from free energy, inter-molecular free energy f, and conformation conf but without per residue contributions, using w as scratch space.
+	result compose_result(const double e, const double f, const conformation& conf, bool from_docking, workspace& w) const;
 
 	double calculate_rf_score(const result& r, const receptor& rec, const forest& f) const;
 
 	//! Writes a given number of conformations from a result container into a output ligand file in PDBQT format.
 	void write_models(const path& output_ligand_path, const vector<result>& results, const receptor& rec) const;
 
+	//! Writes a given number of conformations from a result container into a stream in PDBQT format.
+	void write_models(ostream& os, const vector<result>& results, const receptor& rec) const;
+
 	//! Revisit a result and calculate inter-molecular free energy contribution of every single residue.
 	void calculate_by_comp(result& result, const scoring_function& sf, const receptor& rec, vector<bool>& mask) const;
 
-	void monte_carlo(vector<result>& results, const size_t seed, const scoring_function& sf, const receptor& rec) const;
+	//! Runs a Monte Carlo task with the given seed, saving the clustered results found. Returns false if the task stopped early because the deadline passed.
+	bool monte_carlo(vector<result>& results, const size_t seed, const scoring_function& sf, const receptor& rec, const chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max()) const;
 
 private:
 	//! Represents a pair of interacting atoms that are separated by 3 consecutive covalent bonds.
@@ -95,14 +165,45 @@ private:
 		}
 	};
 
+	//! Represents the subtree of frames moved by an active torsion, and the interacting pairs and frames its mutation affects.
+	class subtree
+	{
+	public:
+		size_t k0; //!< The inclusive beginning index to the frames of the subtree.
+		size_t k1; //!< The exclusive ending index to the frames of the subtree.
+		size_t a0; //!< The inclusive beginning index to the heavy atoms of the subtree.
+		size_t a1; //!< The exclusive ending index to the heavy atoms of the subtree.
+		vector<size_t> inner_pairs; //!< Interacting pairs with both atoms in the subtree, whose distances the torsion keeps.
+		vector<size_t> crossing_pairs; //!< Interacting pairs with exactly one atom in the subtree.
+		vector<size_t> partner_frames; //!< Frames outside the subtree with an atom of a crossing pair.
+	};
+
 	vector<string> lines; //!< Input PDBQT file lines.
 	vector<frame> frames; //!< ROOT and BRANCH frames.
 	vector<atom> heavy_atoms; //!< Heavy atoms. Coordinates are relative to frame origin, which is the first atom by default.
 	vector<atom> hydrogens; //!< Hydrogen atoms. Coordinates are relative to frame origin, which is the first atom by default.
+	array<vector<double>, 3> heavy_coor; //!< Heavy atom coordinates relative to frame origin, stored as structure of arrays for vectorized transformation.
 	size_t num_hydrogens; //!< Number of hydrogens.
 	size_t num_frames; //!< Number of frames.
 	size_t num_torsions; //!< Number of torsions.
 	vector<interacting_pair> interacting_pairs; //!< Non 1-4 interacting pairs.
+	vector<size_t> torsion_frames; //!< Indices of the frames of active torsions.
+	vector<subtree> subtrees; //!< Subtrees moved by active torsions.
+
+	//! Transforms the heavy atoms in [beg, end) by origin o and orientation m into the workspace. Returns true if all of them are within the box.
+	bool transform(const size_t beg, const size_t end, const array<double, 3>& o, const array<double, 9>& m, const receptor& rec, workspace& w) const;
+
+	//! Applies the torsions of conf to the BRANCH frames in [k0, k1), t being the index of the first active torsion among them, and transforms their heavy atoms into the workspace. Returns true if all of them are within the box.
+	bool apply_torsions(const conformation& conf, const size_t k0, const size_t k1, size_t t, const receptor& rec, workspace& w) const;
+
+	//! Reads the inter-molecular free energy and its derivatives of the heavy atoms in [beg, end) from grid maps into the workspace.
+	void read_maps(const size_t beg, const size_t end, const receptor& rec, workspace& w) const;
+
+	//! Aggregates the derivatives of the heavy atoms of frame k into its own force and torque.
+	void aggregate(const size_t k, workspace& w) const;
+
+	//! Aggregates the own force and torque of every frame into its ancestors, and saves the change g.
+	void propagate(change& g, workspace& w) const;
 };
 
 #endif
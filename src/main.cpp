@@ -1,16 +1,16 @@
 #include <chrono>
+#include <deque>
 #include <iostream>
 #include <iomanip>
 #include <filesystem>
 #include <fstream>
 #include <boost/program_options.hpp>
-#include "io_service_pool.hpp"
-#include "safe_counter.hpp"
-#include "random_forest.hpp"
-#include "receptor.hpp"
-#include "ligand.hpp"
+#include "engine.hpp"
+#include "server.hpp"
 #include "pka.hpp"
 #include "string.hpp"
+#include "array.hpp"
+#include "hash.hpp"
 
 void write_energy_report(ofstream& file, vector<result>& results, vector<bool>& mask, receptor& rec, bool with_rf_score, function<double(const result&, const size_t)> e_getter)
 {
@@ -83,15 +83,50 @@ void write_energy_report(ofstream& file, vector<result>& results, vector<bool>&
 	file << endl;
 }
 
+//! Represents a ligand in flight, from being parsed until its row is output.
+class job
+{
+public:
+	const path input_ligand_path; //!< Path to the input ligand file.
+	const string stem; //!< Stem of the input ligand file.
+	unique_ptr<const ligand> lig; //!< Parsed ligand, or null if it failed to parse.
+	array<double, 3> origin; //!< Origin of the input conformation.
+	vector<vector<result>> result_containers; //!< Results of every Monte Carlo task of the current wave.
+	vector<result> results; //!< Clustered results.
+	uint64_t seed_key; //!< Key from which the seeds of Monte Carlo tasks are derived by counter.
+	size_t num_tasks_run; //!< Number of Monte Carlo tasks run so far.
+	size_t num_stable_waves; //!< Number of consecutive waves that did not change the clustered results.
+	size_t num_confs; //!< Number of output conformations.
+	double id_score; //!< idock score of the best conformation.
+	double rf_score; //!< RF-Score of the best conformation.
+	atomic<size_t> num_pending_tasks; //!< Number of Monte Carlo tasks yet to finish.
+	once_flag started; //!< Set by the first Monte Carlo task to start.
+	chrono::steady_clock::time_point deadline; //!< Time after which the Monte Carlo tasks stop.
+	atomic<bool> truncated; //!< Whether any Monte Carlo task stopped at the deadline.
+	bool skipped; //!< Whether the ligand has been docked by a previous run, whose output is reused.
+	stage_times times; //!< Times of the stages of the ligand.
+	event_counts events; //!< Events of the hot paths of the ligand.
+	task_group tasks; //!< Tasks of the job, which finish once the job is complete.
+	exception_ptr error; //!< Exception thrown in processing the ligand, if any.
+
+	//! Constructs a job for the given input ligand, keeping at most max_conformations results. Seeds depend only on the global seed and the ligand file stem, so results do not depend on the order, sharding or number of threads.
+	explicit job(const path& input_ligand_path, const size_t max_conformations, const size_t seed, task_scheduler& scheduler) : input_ligand_path(input_ligand_path), stem(input_ligand_path.stem().string()), seed_key(fnv1a(stem, fnv1a(&seed, sizeof(seed)))), num_tasks_run(0), num_stable_waves(0), num_confs(0), id_score(0), rf_score(0), num_pending_tasks(0), truncated(false), skipped(false), tasks(scheduler)
+	{
+		results.reserve(max_conformations);
+	}
+};
+
 int main(int argc, char* argv[])
 {
 	using namespace std;
 	using namespace std::filesystem;
-	path receptor_path, ligand_path, out_path;
+	path receptor_path, ligand_path, out_path, cache_path;
+	string shard, serve_endpoint;
+	size_t shard_index = 0, num_shards = 1;
 	array<double, 3> center, size;
-	size_t seed, num_threads, num_trees, num_tasks, max_conformations;
-	double granularity, ph;
-	bool score_only, both_score_dock, with_rf_score, precision_mode, remove_nonstd, no_ionize, ignore_errors;
+	size_t seed, num_threads, num_trees, num_tasks, max_tasks, wave_tasks, stable_waves, stable_conformations, max_conformations, max_ligands_in_flight;
+	double granularity, ph, max_seconds_per_ligand;
+	bool score_only, both_score_dock, with_rf_score, precision_mode, remove_nonstd, no_ionize, ignore_errors, longest_first, with_stage_times, with_ligand_events, trilinear, gradient_maps, blocked_maps, huge_pages;
 
 	// Process program options.
 	try
@@ -103,16 +138,22 @@ int main(int argc, char* argv[])
 		const size_t default_num_threads = std::thread::hardware_concurrency();
 		const size_t default_num_trees = 500;
 		const size_t default_num_tasks = 64;
+		const size_t default_max_tasks = 0;
+		const size_t default_wave_tasks = 8;
+		const size_t default_stable_waves = 2;
+		const size_t default_stable_conformations = 3;
 		const size_t default_max_conformations = 9;
+		const size_t default_max_ligands_in_flight = 4;
 		const double default_granularity = 0.125;
 		const double default_ph = 7.4;
+		const double default_max_seconds_per_ligand = 0;
 
 		// Set up options description.
 		using namespace boost::program_options;
 		options_description input_options("input (required)");
 		input_options.add_options()
 			("receptor,r", value<path>(&receptor_path)->required(), "receptor file in PDBQT format")
-			("ligand,l", value<path>(&ligand_path)->required(), "ligand file or folder of ligands in PDBQT format")
+			("ligand,l", value<path>(&ligand_path), "ligand file or folder of ligands in PDBQT format, not required if --serve is on")
 			("center_x,x", value<double>(&center[0]), "x coordinate of the search space center, not required if both --score_only and --precision_mode are on")
 			("center_y,y", value<double>(&center[1]), "y coordinate of the search space center, not required if both --score_only and --precision_mode are on")
 			("center_z,z", value<double>(&center[2]), "z coordinate of the search space center, not required if both --score_only and --precision_mode are on")
@@ -129,17 +170,33 @@ int main(int argc, char* argv[])
 			("seed", value<size_t>(&seed)->default_value(default_seed), "explicit non-negative random seed")
 			("threads", value<size_t>(&num_threads)->default_value(default_num_threads), "number of worker threads to use")
 			("trees", value<size_t>(&num_trees)->default_value(default_num_trees), "number of decision trees in random forest, no effect without --rf_score")
-			("tasks", value<size_t>(&num_tasks)->default_value(default_num_tasks), "number of Monte Carlo tasks for global search")
+			("tasks", value<size_t>(&num_tasks)->default_value(default_num_tasks), "number of Monte Carlo tasks for global search, or the minimum number in adaptive mode")
+			("max_tasks", value<size_t>(&max_tasks)->default_value(default_max_tasks), "maximum number of Monte Carlo tasks in adaptive mode, which follows the first --tasks tasks with waves of --wave_tasks tasks until the top --stable_conformations conformations are stable for --stable_waves waves; 0 disables adaptive mode")
+			("wave_tasks", value<size_t>(&wave_tasks)->default_value(default_wave_tasks), "number of Monte Carlo tasks per wave in adaptive mode")
+			("stable_waves", value<size_t>(&stable_waves)->default_value(default_stable_waves), "number of consecutive waves that leave the top conformations unchanged to stop adaptive mode")
+			("stable_conformations", value<size_t>(&stable_conformations)->default_value(default_stable_conformations), "number of top conformations whose energies and poses must be unchanged for a wave to count as stable in adaptive mode")
 			("conformations,C", value<size_t>(&max_conformations)->default_value(default_max_conformations), "maximum number of binding conformations to write")
+			("max_seconds_per_ligand", value<double>(&max_seconds_per_ligand)->default_value(default_max_seconds_per_ligand, "0"), "wall-clock seconds after which the Monte Carlo tasks of a ligand stop and the results found so far are written, flagged as truncated in the log; 0 means no limit")
+			("ligands_in_flight", value<size_t>(&max_ligands_in_flight)->default_value(default_max_ligands_in_flight), "maximum number of ligands docked concurrently, so that worker threads do not idle between ligands")
 			("granularity,G", value<double>(&granularity)->default_value(default_granularity), "density of probe atoms of grid maps")
 			("score_only,s", bool_switch(&score_only), "scoring input ligand conformation without docking, this option conflicts with --score_dock")
 			("score_dock,d", bool_switch(&both_score_dock), "scoring input ligand conformation as well as docking, this option conflicts with --score_only")
 			("rf_score,R", bool_switch(&with_rf_score), "compute RF-Score as well")
 			("precision_mode,p", bool_switch(&precision_mode), "precise mode in which no precalculated energy grid map is used, requires --score_only or --score_dock")
+			("trilinear", bool_switch(&trilinear), "trilinearly interpolate grid maps for continuous free energy and exact gradients")
+			("gradient_maps", bool_switch(&gradient_maps), "store precalculated gradients next to energies in grid maps, taking 4 times the memory for fewer cache misses")
+			("blocked_maps", bool_switch(&blocked_maps), "lay out grid maps in 4x4x4 blocks of probes so that neighboring probes share pages and cache lines")
+			("huge_pages", bool_switch(&huge_pages), "advise the kernel to back grid maps with transparent huge pages, Linux only")
 			("remove_nonstd,a", bool_switch(&remove_nonstd), "remove non standard residues from receptor")
 			("no_ionize,I", bool_switch(&no_ionize), "do NOT detect or use {ligand name}.pka file, thus no ionization/protonation is performed for ligand")
 			("ignore_errors,E", bool_switch(&ignore_errors), "ignore errors and move on to the next input ligand")
+			("shard", value<string>(&shard), "dock only shard i/N of the input ligands, where 0 <= i < N, selected by a stable hash of the file stem so that N independent runs take disjoint subsets")
+			("longest_first", bool_switch(&longest_first), "dock ligands in descending order of estimated cost from heavy atoms and torsions rather than alphabetically, to shorten the tail of a screening run")
+			("stage_times", bool_switch(&with_stage_times), "add the seconds spent in every stage of a ligand as columns to the log; run totals are always written to the JSON summary next to the log")
+			("ligand_events", bool_switch(&with_ligand_events), "write the hot path event counts of every ligand, e.g. evaluations, rejections, BFGS iterations and Metropolis acceptances, as JSON lines next to the log; run totals are always written to the JSON summary")
 			("ph", value<double>(&ph)->default_value(default_ph, "7.4"), "pH value used to ionize/protonate the input ligand(s)")
+			("serve", value<string>(&serve_endpoint), "instead of docking --ligand, serve ligands sent over a TCP port on the loopback interface or a Unix domain socket path, keeping the receptor, grid maps and scoring function in memory across connections")
+			("cache", value<path>(&cache_path), "folder of cache files shared across runs, holding the scoring function and the grid maps of the same receptor, box and granularity")
 			("help", "this help information")
 			("version", "version information")
 			("config,c", value<path>(), "configuration file to load options from")
@@ -202,7 +259,12 @@ int main(int argc, char* argv[])
 		}
 
 		// Validate ligand_path.
-		if (!exists(ligand_path))
+		if (serve_endpoint.empty() && !vm.count("ligand"))
+		{
+			cerr << "the option '--ligand' is required but missing" << endl;
+			return 1;
+		}
+		if (serve_endpoint.empty() && !exists(ligand_path))
 		{
 			cerr << "Option ligand " << ligand_path << " does not exist" << endl;
 			return 1;
@@ -226,6 +288,27 @@ int main(int argc, char* argv[])
 			}
 		}
 
+		// Validate cache_path.
+		if (!cache_path.empty())
+		{
+			if (exists(cache_path))
+			{
+				if (!is_directory(cache_path))
+				{
+					cerr << "Option cache " << cache_path << " is not a directory" << endl;
+					return 1;
+				}
+			}
+			else
+			{
+				if (!create_directories(cache_path))
+				{
+					cerr << "Failed to create cache folder " << cache_path << endl;
+					return 1;
+				}
+			}
+		}
+
 		// Validate miscellaneous options.
 		if (!num_threads)
 		{
@@ -237,11 +320,67 @@ int main(int argc, char* argv[])
 			cerr << "Option tasks must be 1 or greater" << endl;
 			return 1;
 		}
+		if (max_tasks && max_tasks < num_tasks)
+		{
+			cerr << "Option max_tasks must be 0 or no less than option tasks" << endl;
+			return 1;
+		}
+		if (!wave_tasks)
+		{
+			cerr << "Option wave_tasks must be 1 or greater" << endl;
+			return 1;
+		}
+		if (!stable_waves)
+		{
+			cerr << "Option stable_waves must be 1 or greater" << endl;
+			return 1;
+		}
+		if (!stable_conformations)
+		{
+			cerr << "Option stable_conformations must be 1 or greater" << endl;
+			return 1;
+		}
 		if (!max_conformations)
 		{
 			cerr << "Option conformations must be 1 or greater" << endl;
 			return 1;
 		}
+		if (!shard.empty())
+		{
+			const auto slash = shard.find('/');
+			try
+			{
+				// Both parts must consist of digits only, so that e.g. 1/4x, 1/4/8 and -1/4 are rejected rather than partially parsed.
+				if (slash == string::npos) throw invalid_argument(shard);
+				const string index_part = shard.substr(0, slash), count_part = shard.substr(slash + 1);
+				for (const auto& part : { index_part, count_part })
+				{
+					if (part.empty() || part.find_first_not_of("0123456789") != string::npos) throw invalid_argument(shard);
+				}
+				shard_index = stoul(index_part);
+				num_shards = stoul(count_part);
+			}
+			catch (const exception&)
+			{
+				cerr << "Option shard must be in the form of i/N" << endl;
+				return 1;
+			}
+			if (shard_index >= num_shards)
+			{
+				cerr << "Option shard must satisfy 0 <= i < N" << endl;
+				return 1;
+			}
+		}
+		if (max_seconds_per_ligand < 0)
+		{
+			cerr << "Option max_seconds_per_ligand must be 0 or positive" << endl;
+			return 1;
+		}
+		if (!max_ligands_in_flight)
+		{
+			cerr << "Option ligands_in_flight must be 1 or greater" << endl;
+			return 1;
+		}
 		if (granularity <= 0)
 		{
 			cerr << "Option granularity must be positive" << endl;
@@ -252,6 +391,11 @@ int main(int argc, char* argv[])
 			cerr << "Option --score_only and --score_dock cannot be combined" << endl;
 			return 1;
 		}
+		if (!serve_endpoint.empty() && (score_only || both_score_dock))
+		{
+			cerr << "Option --serve cannot be combined with --score_only or --score_dock" << endl;
+			return 1;
+		}
 		if (precision_mode && !score_only && !both_score_dock)
 		{
 			cerr << "Option --precision_mode must be combined with --score_only or --score_dock" << endl;
@@ -266,19 +410,42 @@ int main(int argc, char* argv[])
 
 	try
 	{
-		// Parse the receptor.
-		cout << "Parsing the receptor " << receptor_path << endl;
-		receptor rec = precision_mode && score_only ? receptor(receptor_path, remove_nonstd) : receptor(receptor_path, remove_nonstd, center, size, granularity);
-		cout << "Found " << rec.atoms.size() << " atoms in " << rec.residues.size() << " residues in receptor " << receptor_path << endl;
+		// Time the whole run for the summary.
+		const auto run_sw = stopwatch::start_new();
 
-		// Reserve storage for result containers.
-		vector<vector<result>> result_containers(num_tasks);
-		for (auto& rc : result_containers)
+		// Parse the receptor and train RF-Score on the fly if requested.
+		cout << "Parsing the receptor " << receptor_path << endl;
+		engine::settings config;
+		config.center = center;
+		config.size = size;
+		config.granularity = granularity;
+		config.use_maps = !(precision_mode && score_only);
+		config.trilinear = trilinear;
+		config.gradient_maps = gradient_maps;
+		config.blocked_maps = blocked_maps;
+		config.huge_pages = huge_pages;
+		config.remove_nonstd = remove_nonstd;
+		config.cache = cache_path;
+		config.num_threads = num_threads;
+		config.seed = seed;
+		config.num_tasks = num_tasks;
+		config.max_conformations = max_conformations;
+		config.with_rf_score = with_rf_score;
+		config.num_trees = num_trees;
+		config.ph = ph;
+		ifstream receptor_ifs(receptor_path);
+		engine eng(receptor_ifs, config, cout);
+		receptor_ifs.close();
+
+		// Seeds of Monte Carlo tasks are derived per ligand.
+		cout << "Deriving per ligand seeds from " << seed << endl;
+
+		// Serve ligands over a socket if requested. This does not return until the process is terminated.
+		if (!serve_endpoint.empty())
 		{
-			rc.reserve(20);	// Maximum number of results obtained from a single Monte Carlo task.
+			server(eng).run(serve_endpoint);
+			return 0;
 		}
-		vector<result> results;
-		results.reserve(max_conformations);
 
 		// Enumerate and sort input ligands.
 		cout << "Enumerating input ligands in " << ligand_path << endl;
@@ -286,8 +453,12 @@ int main(int argc, char* argv[])
 		size_t reserved_name_length = 0;
 		if (is_regular_file(ligand_path))
 		{
-			input_ligand_paths.push_back(ligand_path);
-			reserved_name_length = max(reserved_name_length, ligand_path.stem().string().size());
+			// A single ligand belongs to the shard its stem hashes to, as it would in a folder, so that N runs still dock it exactly once.
+			if (num_shards == 1 || fnv1a(ligand_path.stem().string()) % num_shards == shard_index)
+			{
+				input_ligand_paths.push_back(ligand_path);
+				reserved_name_length = max(reserved_name_length, ligand_path.stem().string().size());
+			}
 		}
 		else
 		{
@@ -297,55 +468,46 @@ int main(int argc, char* argv[])
 				const path input_ligand_path = dir_iter->path();
 				const auto ext = input_ligand_path.extension();
 				if (ext != ".pdbqt" && ext != ".PDBQT") continue;
+
+				// Skip ligands of other shards. Hashing the stem keeps the assignment stable as the library grows.
+				if (num_shards > 1 && fnv1a(input_ligand_path.stem().string()) % num_shards != shard_index) continue;
 				input_ligand_paths.push_back(input_ligand_path);
 				reserved_name_length = max(reserved_name_length, input_ligand_path.stem().string().size());
 			}
 		}
 		const size_t num_input_ligands = input_ligand_paths.size();
+		if (num_shards > 1)
+			cout << "Selected " << num_input_ligands << " input ligands of shard " << shard_index << '/' << num_shards << endl;
 		cout << "Sorting " << num_input_ligands << " input ligands in alphabetical order" << endl;
 		sort(input_ligand_paths.begin(), input_ligand_paths.end());
 
-		// Initialize a Mersenne Twister random number generator.
-		cout << "Seeding a random number generator with " << seed << endl;
-		mt19937_64 rng(seed);
-
-		// Initialize an io service pool and create worker threads for later use.
-		cout << "Creating an io service pool of " << num_threads << " worker threads" << endl;
-		io_service_pool io(num_threads);
-		safe_counter<size_t> cnt;
-
-		// Precalculate the scoring function in parallel.
-		cout << "Calculating a scoring function of " << scoring_function::n << " atom types" << endl;
-		scoring_function sf;
-		cnt.init((sf.n + 1) * sf.n >> 1);
-		for (size_t t1 = 0; t1 < sf.n; ++t1)
-			for (size_t t0 = 0; t0 <= t1; ++t0)
+		// Dispatch the most expensive ligands first so that the cheap ones fill the gaps at the end (LPT scheduling). Ties and the output order remain deterministic.
+		if (longest_first)
+		{
+			cout << "Sorting " << num_input_ligands << " input ligands in descending order of estimated cost" << endl;
+			vector<pair<double, path>> costs;
+			costs.reserve(num_input_ligands);
+			for (auto& input_ligand_path : input_ligand_paths)
 			{
-				io.post([&, t0, t1]()
-					{
-						sf.precalculate(t0, t1);
-						cnt.increment();
-					});
+				double cost = 0;
+				try
+				{
+					cost = ligand::estimate_cost(input_ligand_path);
+				}
+				catch (const exception&)
+				{
+					// Malformed ligands are dispatched last and reported when parsed.
+				}
+				costs.emplace_back(cost, move(input_ligand_path));
 			}
-		cnt.wait();
-		sf.clear();
-
-		forest f(num_trees, seed);
-		if (with_rf_score)
-		{
-			// Train RF-Score on the fly.
-			cout << "Training a random forest of " << num_trees << " trees with " << tree::nv << " variables and " << tree::ns << " samples" << endl;
-			cnt.init(num_trees);
-			for (size_t i = 0; i < num_trees; ++i)
+			stable_sort(costs.begin(), costs.end(), [](const auto& a, const auto& b)
 			{
-				io.post([&, i]()
-					{
-						f[i].train(8, f.u01_s);
-						cnt.increment();
-					});
+				return a.first > b.first;
+			});
+			for (size_t i = 0; i < num_input_ligands; ++i)
+			{
+				input_ligand_paths[i] = move(costs[i].second);
 			}
-			cnt.wait();
-			f.clear();
 		}
 
 		// Limit the minimum and maximum length of output to 16 and 32
@@ -353,7 +515,12 @@ int main(int argc, char* argv[])
 
 		// Output headers to the standard output and the log file.
 		const char separator = '|';
-		cout << "Creating grid maps of " << granularity << " A and running " << num_tasks << " Monte Carlo searches per ligand" << endl;
+		cout << "Creating grid maps of " << granularity << " A and running ";
+		if (max_tasks)
+			cout << num_tasks << " to " << max_tasks;
+		else
+			cout << num_tasks;
+		cout << " Monte Carlo searches per ligand" << endl;
 		cout             << setw( 8) << "Index"
 			<< separator << setw(reserved_name_length) << "Ligand"
 			<< separator << setw( 8) << "Atoms"
@@ -365,26 +532,295 @@ int main(int argc, char* argv[])
 		cout << endl << setprecision(2);
 		cout.setf(ios::fixed, ios::floatfield);
 
-		ofstream log(out_path / (receptor_path.stem().string() + ".csv"));
+		// Shards may share an output folder, so each writes its own log.
+		const string log_stem = receptor_path.stem().string() + (num_shards > 1 ? '_' + to_string(shard_index) + '_' + to_string(num_shards) : string());
+		ofstream log(out_path / (log_stem + ".csv"));
 		log.setf(ios::fixed, ios::floatfield);
 		log << "Ligand,Atoms,Torsions,nConfs,idock score (kcal/mol)";
 		if (with_rf_score)
 			log << ",RF-Score (pKd)";
+		if (max_seconds_per_ligand > 0)
+			log << ",Truncated";
+		if (with_stage_times)
+		{
+			for (size_t s = parsing_ligand; s < num_stages; ++s)
+			{
+				log << ',' << stage_times::names[s] << " (s)";
+			}
+		}
 		log << endl << setprecision(2);
 
-		// Start to dock each input ligand.
+		// Output event counts of every ligand in JSON Lines format if requested.
+		ofstream ligand_events;
+		if (with_ligand_events)
+		{
+			ligand_events.open(out_path / (log_stem + "_events.jsonl"));
+		}
+
+		// Completes a docked ligand, i.e. clusters, scores and writes its conformations. This runs in the task group of the ligand on the thread that finishes its last Monte Carlo task, so that the other workers carry on with the next ligands.
+		const auto complete = [&](job& j)
+		{
+			const ligand& lig = *j.lig;
+			vector<result>& results = j.results;
+			vector<bool> mask(eng.rec.residues.size());
+
+			// To dock, adjust the results merged from all tasks.
+			if (!score_only)
+			{
+				j.num_confs = results.size();
+				if (j.num_confs)
+				{
+					eng.finish(lig, results, mask, j.times);
+					j.id_score = results.front().e_nd;
+					j.rf_score = results.front().rf;
+				}
+			}
+
+			// To run scoring against input ligand.
+			if (score_only || both_score_dock)
+			{
+				++j.num_confs;
+				auto r0 = eng.score(lig, j.origin, precision_mode, mask, j.times);
+				j.id_score = r0.e_nd;
+				j.rf_score = r0.rf;
+				results.insert(results.begin(), move(r0));
+			}
+
+			// If conformations are found, output them.
+			if (j.num_confs)
+			{
+				// Write models to file.
+				const auto sw = stopwatch::start_new();
+				lig.write_models(out_path / j.input_ligand_path.filename(), results, eng.rec);
+
+				// Output per residue energy for all conformations.
+				map<string, function<double(const result&, const size_t)>> schemes
+				{
+					{"gauss1",      [](auto r, auto index) { return r.e_residues[index][0]; } },
+					{"gauss2",      [](auto r, auto index) { return r.e_residues[index][1]; } },
+					{"repulsion",   [](auto r, auto index) { return r.e_residues[index][2]; } },
+					{"hydrophobic", [](auto r, auto index) { return r.e_residues[index][3]; } },
+					{"hbonding",    [](auto r, auto index) { return r.e_residues[index][4]; } },
+					{"gauss",       [](auto r, auto index) { return r.e_residues[index][0] + r.e_residues[index][1]; } },
+					{"steric",      [](auto r, auto index) { return r.e_residues[index][0] + r.e_residues[index][1] + r.e_residues[index][2]; } },
+					{"nonsteric",   [](auto r, auto index) { return r.e_residues[index][3] + r.e_residues[index][4]; } },
+					{"total",       [](auto r, auto index) { return r.e_residues[index][5]; } },
+				};
+
+				for (auto& [postfix, getter] : schemes)
+				{
+					auto stream = ofstream(out_path / (j.stem + '_' + postfix + ".csv"));
+					write_energy_report(
+						stream,
+						results,
+						mask,
+						eng.rec,
+						with_rf_score,
+						getter);
+				}
+				j.times.add(writing_output, sw);
+			}
+
+			// Release the results of the current ligand.
+			vector<result>().swap(results);
+		};
+
+		// Runs a wave of n Monte Carlo tasks of a job. Task k of the job is seeded with the k-th output of a counter-based generator keyed by the job.
+		function<void(job&, const size_t)> run_wave;
+
+		// Merges the results of a finished wave into one single result container in task order. In adaptive mode, another wave is run unless the clustered results have not changed for stable_waves waves or max_tasks tasks have run, and otherwise the job is completed.
+		const auto finish_wave = [&](job& j)
+		{
+			const auto sw = stopwatch::start_new();
+			const double required_square_error = static_cast<double>(4 * j.lig->num_heavy_atoms); // Ligands with RMSD < 2.0 will be clustered into the same cluster.
+			const vector<result> previous = max_tasks ? j.results : vector<result>();
+			for (auto& result_container : j.result_containers)
+			{
+				for (auto& result : result_container)
+				{
+					result::push(j.results, move(result), required_square_error);
+				}
+				result_container.clear();
+			}
+			j.times.add(clustering, sw);
+
+			if (max_tasks && j.num_tasks_run < max_tasks && !j.truncated)
+			{
+				// The results are stable if each of the top stable_conformations clusters keeps its energy within 0.01 kcal/mol and its representative within 2.0 A RMSD.
+				const size_t k = min(stable_conformations, j.results.size());
+				bool stable = previous.size() >= k;
+				for (size_t i = 0; stable && i < k; ++i)
+				{
+					stable = abs(j.results[i].e - previous[i].e) < 0.01 && distance_sqr(j.results[i].heavy_atoms, previous[i].heavy_atoms) < required_square_error;
+				}
+				j.num_stable_waves = stable ? j.num_stable_waves + 1 : 0;
+				if (j.num_stable_waves < stable_waves)
+				{
+					run_wave(j, min(wave_tasks, max_tasks - j.num_tasks_run));
+					return;
+				}
+			}
+			vector<vector<result>>().swap(j.result_containers);
+			complete(j);
+		};
+
+		run_wave = [&](job& j, const size_t n)
+		{
+			const size_t k0 = j.num_tasks_run;
+			j.result_containers.resize(n);
+			j.num_pending_tasks = n;
+			j.num_tasks_run += n;
+			for (size_t i = 0; i < n; ++i)
+			{
+				j.result_containers[i].reserve(20); // Maximum number of results obtained from a single Monte Carlo task.
+				const size_t s = splitmix64(j.seed_key, k0 + i);
+				j.tasks.run([&, i, s]()
+					{
+						// Events of clustering a wave and completing the job are counted along with those of the last task.
+						event_scope scope(j.events);
+
+						// The time budget starts when the ligand starts running rather than when it is queued behind other ligands.
+						call_once(j.started, [&]()
+							{
+								// A budget beyond the range of the clock, e.g. 1e300 seconds, means no limit rather than an overflowed deadline in the past.
+								const auto now = chrono::steady_clock::now();
+								const chrono::duration<double> budget(max_seconds_per_ligand);
+								j.deadline = max_seconds_per_ligand > 0 && budget < chrono::steady_clock::time_point::max() - now ? now + chrono::duration_cast<chrono::steady_clock::duration>(budget) : chrono::steady_clock::time_point::max();
+							});
+						const auto sw = stopwatch::start_new();
+						if (!j.lig->monte_carlo(j.result_containers[i], s, eng.sf, eng.rec, j.deadline))
+						{
+							j.truncated = true;
+						}
+						j.times.add(monte_carlo, sw);
+						if (--j.num_pending_tasks == 0)
+						{
+							finish_wave(j);
+						}
+					});
+			}
+		};
+
+		// Jobs in flight in input order. Only the oldest job is reported, so the output order does not depend on the completion order.
+		deque<unique_ptr<job>> jobs;
 		size_t index = 0;
-		for (const auto& input_ligand_path : input_ligand_paths)
+
+		// Counts of ligands by outcome for the summary.
+		size_t num_docked = 0, num_skipped = 0, num_errors = 0, num_truncated = 0, num_tasks_run = 0;
+
+		// Waits for the oldest job and outputs its row to the standard output and the log file.
+		const auto report = [&]()
 		{
+			job& j = *jobs.front();
+			try
+			{
+				j.tasks.wait();
+			}
+			catch (const exception&)
+			{
+				j.error = current_exception();
+			}
+			eng.times += j.times;
+			eng.events += j.events;
+
 			// Output the ligand file stem.
-			const string stem = input_ligand_path.stem().string();
 			cout             << setw(8) << ++index
-				<< separator << setw(reserved_name_length) << stem
-				<< flush;
-			if (stem.find(',') != string::npos)
-				log << '"' << stem << '"';
+				<< separator << setw(reserved_name_length) << j.stem;
+			log << csv_quote(j.stem);
+
+			if (j.lig)
+			{
+				cout << separator << setw(8) << j.lig->num_heavy_atoms
+					<< separator << setw(8) << j.lig->num_active_torsions;
+				log << ',' << j.lig->num_heavy_atoms << ',' << j.lig->num_active_torsions;
+			}
+
+			if (j.error)
+			{
+				++num_errors;
+				cout << endl;
+				log << endl;
+				try
+				{
+					rethrow_exception(j.error);
+				}
+				catch (const exception& e)
+				{
+					if (!ignore_errors)
+						throw;
+					cerr << "ERROR: " << e.what() << " in processing " << j.input_ligand_path << endl;
+				}
+			}
 			else
-				log << stem;
+			{
+				if (j.skipped)
+				{
+					++num_skipped;
+				}
+				else
+				{
+					++num_docked;
+					num_truncated += j.truncated;
+					num_tasks_run += j.num_tasks_run;
+				}
+
+				// If output file or conformations are found, output the idock score and RF-Score.
+				cout << separator << setw(6) << j.num_confs;
+				log << ',' << j.num_confs;
+				if (j.num_confs)
+				{
+					cout << separator << setw(22) << j.id_score;
+					log << ',' << j.id_score;
+					if (with_rf_score)
+					{
+						cout << separator << setw(14) << j.rf_score;
+						log << ',' << j.rf_score;
+					}
+				}
+				if (!j.num_confs && (max_seconds_per_ligand > 0 || with_stage_times))
+				{
+					log << (with_rf_score ? ",," : ",");
+				}
+				if (max_seconds_per_ligand > 0)
+				{
+					log << ',' << j.truncated;
+				}
+				if (with_stage_times)
+				{
+					log << setprecision(3);
+					for (size_t s = parsing_ligand; s < num_stages; ++s)
+					{
+						log << ',' << j.times.seconds(static_cast<stage>(s));
+					}
+					log << setprecision(2);
+				}
+				cout << endl;
+				log << endl;
+
+				if (with_ligand_events && !j.skipped)
+				{
+					ligand_events << "{\"ligand\": " << json_quote(j.stem) << ", \"monte_carlo_tasks\": " << j.num_tasks_run;
+					for (size_t e = 0; e < num_events; ++e)
+					{
+						ligand_events << ", \"" << event_counts::names[e] << "\": " << j.events[e];
+					}
+					ligand_events << "}\n";
+				}
+
+				// Output to the log file in csv format. The log file can be sorted using: head -1 log.csv && tail -n +2 log.csv | awk -F, '{ printf "%s,%s\n", $2||0, $0 }' | sort -t, -k1nr -k6n | cut -d, -f2-
+			}
+			jobs.pop_front();
+		};
+
+		// Start to dock each input ligand, keeping up to max_ligands_in_flight ligands in flight.
+		for (const auto& input_ligand_path : input_ligand_paths)
+		{
+			if (jobs.size() == max_ligands_in_flight)
+			{
+				report();
+			}
+			jobs.push_back(make_unique<job>(input_ligand_path, max_conformations, seed, eng.scheduler));
+			job& j = *jobs.back();
 
 			// Detect and parse {ligand}.pka file.
 			pka ligand_pka;
@@ -402,16 +838,12 @@ int main(int argc, char* argv[])
 			try
 			{
 				// Parse the ligand.
-				array<double, 3> origin;
-				const ligand lig(input_ligand_path, origin, ligand_pka, ph);
-				cout << separator << setw(8) << lig.num_heavy_atoms
-					<< separator << setw(8) << lig.num_active_torsions;
-				log << ',' << lig.num_heavy_atoms << ',' << lig.num_active_torsions;
+				const auto sw = stopwatch::start_new();
+				j.lig = make_unique<const ligand>(input_ligand_path, j.origin, ligand_pka, ph);
+				const ligand& lig = *j.lig;
+				j.times.add(parsing_ligand, sw);
 
 				// Check if the current ligand has already been docked.
-				size_t num_confs = 0;
-				double id_score = 0;
-				double rf_score = 0;
 				const path output_ligand_path = out_path / input_ligand_path.filename();
 				if (exists(output_ligand_path) && !equivalent(ligand_path, out_path))
 				{
@@ -422,211 +854,91 @@ int main(int argc, char* argv[])
 						const string record = line.substr(0, 10);
 						if (record == "MODEL     ")
 						{
-							++num_confs;
+							++j.num_confs;
 						}
-						else if (num_confs == 1 && record == "REMARK 921")
+						else if (j.num_confs == 1 && record == "REMARK 921")
 						{
-							id_score = stod(line.substr(55, 8));
+							j.id_score = stod(line.substr(55, 8));
 						}
-						else if (num_confs == 1 && record == "REMARK 927")
+						else if (j.num_confs == 1 && record == "REMARK 927")
 						{
-							rf_score = stod(line.substr(55, 8));
+							j.rf_score = stod(line.substr(55, 8));
 						}
 					}
+					j.skipped = true;
+					continue;
 				}
-				else
-				{
-					// Precise mode uses grid maps if docking is going to perform as well.
-					if (rec.use_maps)
-					{
-						// Find atom types that are present in the current ligand but not present in the grid maps.
-						vector<size_t> xs;
-						for (size_t t = 0; t < sf.n; ++t)
-						{
-							if (lig.xs[t] && rec.init_e(t))
-							{
-								xs.push_back(t);
-							}
-						}
-
-						// Create grid maps on the fly if necessary.
-						if (xs.size())
-						{
-							// Precalculate p_offset.
-							rec.precalculate(xs);
-
-							// Populate the grid map task container.
-							cnt.init(rec.num_probes[2]);
-							for (size_t z = 0; z < rec.num_probes[2]; ++z)
-							{
-								io.post([&, z]()
-									{
-										rec.populate(xs, z, sf);
-										cnt.increment();
-									});
-							}
-							cnt.wait();
-						}
-					}
-
-					vector<bool> mask(rec.residues.size());
-
-					// To dock, search conformations.
-					if (!score_only)
-					{
-						// Run the Monte Carlo tasks.
-						cnt.init(num_tasks);
-						for (size_t i = 0; i < num_tasks; ++i)
-						{
-							assert(result_containers[i].empty());
-							const size_t s = rng();
-							io.post([&, i, s]()
-								{
-									lig.monte_carlo(result_containers[i], s, sf, rec);
-									cnt.increment();
-								});
-						}
-						cnt.wait();
-
-						// Merge results from all tasks into one single result container.
-						assert(results.empty());
-						const double required_square_error = static_cast<double>(4 * lig.num_heavy_atoms); // Ligands with RMSD < 2.0 will be clustered into the same cluster.
-						for (auto& result_container : result_containers)
-						{
-							for (auto& result : result_container)
-							{
-								result::push(results, move(result), required_square_error);
-							}
-							result_container.clear();
-						}
-
-						num_confs = results.size();
-						if (num_confs)
-						{
-							// Adjust free energy relative to the best conformation and flexibility.
-							const auto& best_result = results.front();
-							const double best_result_intra_e = best_result.e - best_result.f;
-							for (auto& result : results)
-							{
-								result.e_nd = (result.e - best_result_intra_e) * lig.flexibility_penalty_factor;
-								if (with_rf_score)
-								{
-									result.rf = lig.calculate_rf_score(result, rec, f);
-								}
-								// Result from compose_result is not complete and need to be completed.
-								lig.calculate_by_comp(result, sf, rec, mask);
-							}
-							id_score = best_result.e_nd;
-							rf_score = best_result.rf;
-						}
-					}
-
-					// To run scoring against input ligand.
-					if (score_only || both_score_dock)
-					{
-						++num_confs;
-						if (precision_mode)
-						{
-							// The returned result is complete with per residue/heavy_atom energy.
-							auto r0 = lig.complete_result_noconf(origin, sf, rec, mask);
-							r0.e_nd = r0.f * lig.flexibility_penalty_factor;
-							if (with_rf_score)
-							{
-								r0.rf = lig.calculate_rf_score(r0, rec, f);
-							}
-							id_score = r0.e_nd;
-							rf_score = r0.rf;
-							results.insert(results.begin(), move(r0));
-						}
-						else
-						{
-							conformation c0(lig.num_active_torsions);
-							c0.position = origin;
-							double e0, f0;
-							change g0(0);
-							lig.evaluate(c0, sf, rec, -99, e0, f0, g0);
-							auto r0 = lig.compose_result(e0, f0, c0, false);
-							r0.e_nd = r0.f * lig.flexibility_penalty_factor;
-							if (with_rf_score)
-							{
-								r0.rf = lig.calculate_rf_score(r0, rec, f);
-							}
-							// Result from compose_result is not complete and need to be completed.
-							lig.calculate_by_comp(r0, sf, rec, mask);
-							id_score = r0.e_nd;
-							rf_score = r0.rf;
-							results.insert(results.begin(), move(r0));
-						}
-					}
 
-					// If conformations are found, output them.
-					if (num_confs)
-					{
-						// Write models to file.
-						lig.write_models(output_ligand_path, results, rec);
-
-						// Output per residue energy for all conformations.
-						map<string, function<double(const result&, const size_t)>> schemes
-						{
-							{"gauss1",      [](auto r, auto index) { return r.e_residues[index][0]; } },
-							{"gauss2",      [](auto r, auto index) { return r.e_residues[index][1]; } },
-							{"repulsion",   [](auto r, auto index) { return r.e_residues[index][2]; } },
-							{"hydrophobic", [](auto r, auto index) { return r.e_residues[index][3]; } },
-							{"hbonding",    [](auto r, auto index) { return r.e_residues[index][4]; } },
-							{"gauss",       [](auto r, auto index) { return r.e_residues[index][0] + r.e_residues[index][1]; } },
-							{"steric",      [](auto r, auto index) { return r.e_residues[index][0] + r.e_residues[index][1] + r.e_residues[index][2]; } },
-							{"nonsteric",   [](auto r, auto index) { return r.e_residues[index][3] + r.e_residues[index][4]; } },
-							{"total",       [](auto r, auto index) { return r.e_residues[index][5]; } },
-						};
-
-						for (auto& [postfix, getter] : schemes)
-						{
-							auto stream = ofstream(out_path / (stem + '_' + postfix + ".csv"));
-							write_energy_report(
-								stream,
-								results,
-								mask,
-								rec,
-								with_rf_score,
-								getter);
-						}
-
-						// Clear the results of the current ligand.
-						results.clear();
-					}
+				// Precalculate the scoring function and create grid maps on the fly if necessary, though precise mode uses grid maps only if docking is going to perform as well. Jobs in flight only read the tables and maps of their own atom types, which are all present already, and the new ones are calculated alongside their Monte Carlo tasks.
+				if (!eng.prepare(lig, j.times, j.events))
+				{
+					cerr << "WARNING: failed to write scoring function or grid map cache in " << cache_path << endl;
 				}
 
-				// If output file or conformations are found, output the idock score and RF-Score.
-				cout << separator << setw(6) << num_confs;
-				log << ',' << num_confs;
-				if (num_confs)
+				// To dock, run the first wave of Monte Carlo tasks.
+				if (!score_only)
 				{
-					cout << separator << setw(22) << id_score;
-					log << ',' << id_score;
-					if (with_rf_score)
-					{
-						cout << separator << setw(14) << rf_score;
-						log << ',' << rf_score;
-					}
+					run_wave(j, num_tasks);
+				}
+				else
+				{
+					j.tasks.run([&]()
+						{
+							// Scoring evaluates the ligand, whose events are counted as those of the job.
+							event_scope scope(j.events);
+							complete(j);
+						});
 				}
-				cout << endl;
-				log << endl;
-
-				// Output to the log file in csv format. The log file can be sorted using: head -1 log.csv && tail -n +2 log.csv | awk -F, '{ printf "%s,%s\n", $2||0, $0 }' | sort -t, -k1nr -k6n | cut -d, -f2-
 			}
-			catch (const exception& e)
+			catch (const exception&)
 			{
-				cout << endl;
-				log << endl;
-				if (!ignore_errors)
-					throw;
-				else
-					cerr << "ERROR: " << e.what() << " in processing " << input_ligand_path << endl;
+				j.error = current_exception();
 			}
 		}
 
-		// Wait until the io service pool has finished all its tasks.
-		io.wait();
+		// Output the remaining jobs.
+		while (!jobs.empty())
+		{
+			report();
+		}
+
+		// Output a summary of the run in JSON format. Stage times of concurrent ligands and tasks are summed, so they may exceed the wall-clock time.
+		ofstream summary(out_path / (log_stem + ".json"));
+		summary.setf(ios::fixed, ios::floatfield);
+		summary << setprecision(3)
+			<< "{\n"
+			<< "  \"ligands\": " << num_input_ligands << ",\n"
+			<< "  \"docked\": " << num_docked << ",\n"
+			<< "  \"skipped\": " << num_skipped << ",\n"
+			<< "  \"errors\": " << num_errors << ",\n"
+			<< "  \"truncated\": " << num_truncated << ",\n"
+			<< "  \"threads\": " << num_threads << ",\n"
+			<< "  \"monte_carlo_tasks\": " << num_tasks_run << ",\n"
+			<< "  \"granularity\": " << granularity << ",\n"
+			<< "  \"wall_seconds\": " << run_sw.elapsed_sec() << ",\n"
+			<< "  \"stage_seconds\": {";
+		for (size_t s = 0; s < num_stages; ++s)
+		{
+			summary << (s ? ",\n" : "\n") << "    \"" << stage_times::names[s] << "\": " << eng.times.seconds(static_cast<stage>(s));
+		}
+		summary << "\n  },\n  \"events\": {";
+		for (size_t e = 0; e < num_events; ++e)
+		{
+			summary << (e ? ",\n" : "\n") << "    \"" << event_counts::names[e] << "\": " << eng.events[e];
+		}
+
+		// Derive the rates that tell whether compute is wasted, e.g. on conformations out of a box that is too small, or on Monte Carlo steps that are rarely accepted.
+		const auto ratio = [](const double numerator, const double denominator)
+		{
+			return denominator ? numerator / denominator : 0.0;
+		};
+		summary << "\n  },\n"
+			<< "  \"rejection_rate_out_of_box\": " << ratio(eng.events[rejections_out_of_box], eng.events[evaluations]) << ",\n"
+			<< "  \"rejection_rate_over_bound\": " << ratio(eng.events[rejections_over_bound], eng.events[evaluations]) << ",\n"
+			<< "  \"metropolis_acceptance_rate\": " << ratio(eng.events[metropolis_acceptances], eng.events[monte_carlo_steps]) << ",\n"
+			<< "  \"bfgs_iterations_per_step\": " << ratio(eng.events[bfgs_iterations], eng.events[monte_carlo_steps]) << ",\n"
+			<< "  \"evaluations_per_step\": " << ratio(eng.events[evaluations], eng.events[monte_carlo_steps]) << "\n"
+			<< "}\n";
 		return 0;
 	}
 	catch (const exception& e)
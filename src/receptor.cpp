@@ -1,35 +1,75 @@
 #include <cmath>
 #include <cassert>
+#include <algorithm>
 #include <fstream>
+#include <sstream>
+#include <iomanip>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include "matrix.hpp"
+#include "hash.hpp"
 #include "scoring_function.hpp"
 #include "array.hpp"
 #include "string.hpp"
 #include "residue.hpp"
 #include "receptor.hpp"
+#include "events.hpp"
+
+const double receptor::cell_size = scoring_function::cutoff * 0.5;
 
 receptor::receptor(const path& p, bool remove_nonstd)
+	: receptor(*make_unique<ifstream>(p), remove_nonstd)
+{
+}
+
+receptor::receptor(istream& is, bool remove_nonstd)
 	: p_offset()
+	, map_buffers()
 	, maps()
 	, center()
 	, size()
+	, fingerprint()
 	, use_maps(false)
+	, trilinear(false)
+	, gradient_maps(false)
+	, map_stride(1)
+	, blocked_maps(false)
+	, huge_pages(false)
 	, corner0()
 	, corner1()
 	, granularity()
 	, granularity_inverse()
 	, num_probes()
 	, num_probes_product()
+	, num_tiles()
+	, num_tiles_product()
+	, num_blocks()
+	, map_size()
+	, xs()
 {
-	parse_pdbqt(p, remove_nonstd);
+	parse_pdbqt(is, remove_nonstd);
 }
 
-receptor::receptor(const path& p, bool remove_nonstd, const array<double, 3>& center, const array<double, 3>& size, const double granularity)
+receptor::receptor(const path& p, bool remove_nonstd, const array<double, 3>& center, const array<double, 3>& size, const double granularity, const bool trilinear, const bool gradient_maps, const bool blocked_maps, const bool huge_pages)
+	: receptor(*make_unique<ifstream>(p), remove_nonstd, center, size, granularity, trilinear, gradient_maps, blocked_maps, huge_pages)
+{
+}
+
+receptor::receptor(istream& is, bool remove_nonstd, const array<double, 3>& center, const array<double, 3>& size, const double granularity, const bool trilinear, const bool gradient_maps, const bool blocked_maps, const bool huge_pages)
 	: p_offset(scoring_function::n)
+	, map_buffers(scoring_function::n)
 	, maps(scoring_function::n)
 	, center(center)
 	, size(size)
+	, fingerprint()
 	, use_maps(true)
+	, trilinear(trilinear)
+	, gradient_maps(gradient_maps)
+	, map_stride(gradient_maps ? 4 : 1)
+	, blocked_maps(blocked_maps)
+	, huge_pages(huge_pages)
 	, corner0(center - 0.5 * size)
 	, corner1(corner0 + size)
 	, granularity(granularity)
@@ -40,11 +80,24 @@ receptor::receptor(const path& p, bool remove_nonstd, const array<double, 3>& ce
 		static_cast<size_t>(size[2] * granularity_inverse) + 2
 	}})
 	, num_probes_product(num_probes[0] * num_probes[1] * num_probes[2])
+	, num_tiles({{
+		(num_probes[0] + tile_size - 1) / tile_size,
+		(num_probes[1] + tile_size - 1) / tile_size,
+		(num_probes[2] + tile_size - 1) / tile_size
+	}})
+	, num_tiles_product(num_tiles[0] * num_tiles[1] * num_tiles[2])
+	, num_blocks({{
+		(num_probes[0] + block_size - 1) / block_size,
+		(num_probes[1] + block_size - 1) / block_size,
+		(num_probes[2] + block_size - 1) / block_size
+	}})
+	, map_size(map_stride * (blocked_maps ? num_blocks[0] * num_blocks[1] * num_blocks[2] * block_size * block_size * block_size : num_probes_product))
+	, xs()
 {
-	parse_pdbqt(p, remove_nonstd);
+	parse_pdbqt(is, remove_nonstd);
 }
 
-void receptor::parse_pdbqt(const path& p, bool remove_nonstd)
+void receptor::parse_pdbqt(istream& is, bool remove_nonstd)
 {
 	// Initialize necessary variables for constructing a receptor.
 	atoms.reserve(5000); // A receptor typically consists of <= 5,000 atoms.
@@ -56,6 +109,9 @@ void receptor::parse_pdbqt(const path& p, bool remove_nonstd)
 	size_t residue_idx = SIZE_MAX; // The index in residues of the current residue.
 	char altloc = 0; // Alternate location indicator.
 
+	// The fingerprint covers the parsing options and every line, independent of line feedings.
+	fingerprint = fnv1a(&remove_nonstd, sizeof(remove_nonstd));
+
 	string line;
 
 	// Start parsing.
@@ -73,8 +129,9 @@ void receptor::parse_pdbqt(const path& p, bool remove_nonstd)
 	//   -l GEN             add hydrogens with generic organic molecule.
 	//   -r APOLAR          remove non-polar hydrogens.
 	//   -w                 remove water.
-	for (ifstream ifs(p); safe_getline(ifs, line);)
+	while (safe_getline(is, line))
 	{
+		fingerprint = fnv1a("\n", 1, fnv1a(line, fingerprint));
 		const string record = line.substr(0, 6);
 		if (record == "ATOM  " || record == "HETATM")
 		{
@@ -206,41 +263,199 @@ void receptor::parse_pdbqt(const path& p, bool remove_nonstd)
 			residue_seq = "XXXX";
 		}
 	}
+
+	// Record the atom types present, which the scoring function is precalculated for.
+	for (const auto& a : atoms)
+	{
+		xs[a.xs] = true;
+	}
+
+	index_atoms();
+}
+
+void receptor::index_atoms()
+{
+	// Determine the bounding box of atoms.
+	array<double, 3> corner1;
+	cell_corner = corner1 = atoms.empty() ? array<double, 3>{} : atoms.front().coord;
+	for (const auto& a : atoms)
+	{
+		for (size_t i = 0; i < 3; ++i)
+		{
+			cell_corner[i] = min(cell_corner[i], a.coord[i]);
+			corner1[i] = max(corner1[i], a.coord[i]);
+		}
+	}
+	for (size_t i = 0; i < 3; ++i)
+	{
+		num_cells[i] = static_cast<size_t>((corner1[i] - cell_corner[i]) / cell_size) + 1;
+	}
+
+	// Count atoms per cell, and convert the counts to offsets.
+	vector<size_t> cells(atoms.size());
+	cell_offsets.assign(num_cells[0] * num_cells[1] * num_cells[2] + 1, 0);
+	for (size_t i = 0; i < atoms.size(); ++i)
+	{
+		const auto& c = atoms[i].coord;
+		cells[i] = num_cells[0] * (num_cells[1] * static_cast<size_t>((c[2] - cell_corner[2]) / cell_size) + static_cast<size_t>((c[1] - cell_corner[1]) / cell_size)) + static_cast<size_t>((c[0] - cell_corner[0]) / cell_size);
+		++cell_offsets[cells[i] + 1];
+	}
+	for (size_t k = 1; k < cell_offsets.size(); ++k)
+	{
+		cell_offsets[k] += cell_offsets[k - 1];
+	}
+
+	// Fill cells in ascending order of atom indices.
+	vector<size_t> ends(cell_offsets.begin(), cell_offsets.end() - 1);
+	cell_atoms.resize(atoms.size());
+	for (size_t i = 0; i < atoms.size(); ++i)
+	{
+		cell_atoms[ends[cells[i]]++] = i;
+	}
 }
 
-bool receptor::within(const array<double, 3>& coord) const
+void receptor::atoms_near(const array<double, 3>& lo, const array<double, 3>& hi, const double r, vector<size_t>& indices) const
+{
+	indices.clear();
+
+	// Find the range of cells overlapping the box expanded by r.
+	array<size_t, 3> beg, end;
+	for (size_t i = 0; i < 3; ++i)
+	{
+		const double l = (lo[i] - r - cell_corner[i]) / cell_size;
+		const double u = (hi[i] + r - cell_corner[i]) / cell_size;
+		if (u < 0)
+			return;
+		beg[i] = l > 0 ? static_cast<size_t>(l) : 0;
+		end[i] = min(static_cast<size_t>(u) + 1, num_cells[i]);
+		if (beg[i] >= end[i])
+			return;
+	}
+
+	// Collect atoms within r of the box.
+	const double r2 = r * r;
+	for (size_t z = beg[2]; z < end[2]; ++z)
+	{
+		for (size_t y = beg[1]; y < end[1]; ++y)
+		{
+			// Cells along x are adjacent, so their atoms form one contiguous range.
+			const size_t row = num_cells[0] * (num_cells[1] * z + y);
+			for (size_t k = cell_offsets[row + beg[0]]; k < cell_offsets[row + end[0]]; ++k)
+			{
+				const size_t i = cell_atoms[k];
+				const auto& c = atoms[i].coord;
+				double d2 = 0;
+				for (size_t j = 0; j < 3; ++j)
+				{
+					const double d = c[j] < lo[j] ? lo[j] - c[j] : (c[j] > hi[j] ? c[j] - hi[j] : 0);
+					d2 += d * d;
+				}
+				if (d2 < r2)
+					indices.push_back(i);
+			}
+		}
+	}
+
+	// Restore the ascending order of atom indices so that energies are aggregated in the same order as a full scan.
+	sort(indices.begin(), indices.end());
+}
+
+bool receptor::init_e(const size_t xs)
 {
 	assert(use_maps);
-	return corner0[0] <= coord[0] && coord[0] < corner1[0]
-		&& corner0[1] <= coord[1] && coord[1] < corner1[1]
-		&& corner0[2] <= coord[2] && coord[2] < corner1[2];
+	if (maps[xs])
+		return false;
+
+	// Use the cached grid map if present.
+	if (cache && (maps[xs] = static_cast<const fl*>(cache->block(xs))))
+		return false;
+
+	map_buffers[xs].reserve(map_size);
+#ifdef __linux__
+	// Huge pages cut TLB misses of scattered lookups. The advice is given before the buffer is first touched, and is best effort.
+	if (huge_pages)
+	{
+		// The buffer starts at a page boundary by its allocator, unless pages are larger than 4 KiB.
+		const uintptr_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+		const uintptr_t beg = (reinterpret_cast<uintptr_t>(map_buffers[xs].data()) + page_mask) & ~page_mask;
+		const uintptr_t end = reinterpret_cast<uintptr_t>(map_buffers[xs].data() + map_size) & ~page_mask;
+		if (beg < end)
+		{
+			madvise(reinterpret_cast<void*>(beg), end - beg, MADV_HUGEPAGE);
+		}
+	}
+#endif
+	map_buffers[xs].resize(map_size);
+	maps[xs] = map_buffers[xs].data();
+	return true;
 }
 
-array<size_t, 3> receptor::index(const array<double, 3>& coord) const
+void receptor::open_cache(const path& folder)
 {
 	assert(use_maps);
-	return
-	{{
-		static_cast<size_t>((coord[0] - corner0[0]) * granularity_inverse),
-		static_cast<size_t>((coord[1] - corner0[1]) * granularity_inverse),
-		static_cast<size_t>((coord[2] - corner0[2]) * granularity_inverse),
-	}};
+
+	// The key covers everything that grid map values depend on.
+	uint64_t key = fingerprint;
+	key = fnv1a(center.data(), sizeof(center), key);
+	key = fnv1a(size.data(), sizeof(size), key);
+	key = fnv1a(&granularity, sizeof(granularity), key);
+	key = fnv1a(num_probes.data(), sizeof(num_probes), key);
+	const uint64_t sf_key = scoring_function::key();
+	key = fnv1a(&sf_key, sizeof(sf_key), key);
+	key = fnv1a(&map_stride, sizeof(map_stride), key);
+	key = fnv1a(&blocked_maps, sizeof(blocked_maps), key);
+
+	ostringstream name;
+	name << hex << setw(16) << setfill('0') << key << ".maps";
+	cache = make_unique<cache_file>(folder / name.str(), key, scoring_function::n, sizeof(fl) * map_size);
 }
 
-size_t receptor::index(const array<size_t, 3>& idx) const
+bool receptor::cache_maps(const vector<size_t>& xs)
 {
 	assert(use_maps);
-	return num_probes[0] * (num_probes[1] * idx[2] + idx[1]) + idx[0];
+	if (!cache)
+		return true;
+
+	vector<pair<size_t, const void*>> blocks;
+	blocks.reserve(xs.size());
+	for (const size_t t : xs)
+	{
+		blocks.emplace_back(t, map_buffers[t].data());
+	}
+	if (!cache->append(blocks))
+		return false;
+
+	// Switch to the mapped blocks so that the owned buffers can be released.
+	for (const size_t t : xs)
+	{
+		if (const auto block = static_cast<const fl*>(cache->block(t)))
+		{
+			maps[t] = block;
+			map_buffer().swap(map_buffers[t]);
+		}
+	}
+	return true;
 }
 
 array<size_t, 3> receptor::coord(const size_t index) const
 {
 	assert(use_maps);
+	if (!blocked_maps)
+	{
+		return
+		{{
+			index % num_probes[0],
+			index / num_probes[0] % num_probes[1],
+			index / num_probes[0] / num_probes[1],
+		}};
+	}
+	const size_t b = index / (block_size * block_size * block_size);
+	const size_t i = index % (block_size * block_size * block_size);
 	return
 	{{
-		index % num_probes[0],
-		index / num_probes[0] % num_probes[1],
-		index / num_probes[0] / num_probes[1],
+		b % num_blocks[0] * block_size + i % block_size,
+		b / num_blocks[0] % num_blocks[1] * block_size + i / block_size % block_size,
+		b / num_blocks[0] / num_blocks[1] * block_size + i / block_size / block_size,
 	}};
 }
 
@@ -271,65 +486,195 @@ void receptor::precalculate(const vector<size_t>& xs)
 	}
 }
 
-void receptor::populate(const vector<size_t>& xs, const size_t z, const scoring_function& sf)
+void receptor::populate(const vector<size_t>& xs, const size_t t, const scoring_function& sf)
 {
 	assert(use_maps);
+	assert(t < num_tiles[0] * num_tiles[1] * num_tiles[2]);
 	const size_t n = xs.size();
-	const double z_coord = corner0[2] + granularity * z;
-	const size_t z_offset = num_probes[0] * num_probes[1] * z;
+
+	// Find the range of probes of the current tile.
+	const array<size_t, 3> tile
+	{{
+		t % num_tiles[0],
+		t / num_tiles[0] % num_tiles[1],
+		t / num_tiles[0] / num_tiles[1],
+	}};
+	array<size_t, 3> beg, end, ext;
+	for (size_t i = 0; i < 3; ++i)
+	{
+		beg[i] = tile[i] * tile_size;
+		end[i] = min(beg[i] + tile_size, num_probes[i]);
+		ext[i] = end[i] - beg[i];
+	}
+
+	// Accumulate energies in double precision into a contiguous tile buffer, which stays in cache while being written.
+	const size_t tile_probes = ext[0] * ext[1] * ext[2];
+	vector<double> buffer(n * tile_probes);
 
 	assert(atoms.size() < UINT16_MAX);
 
-	for (size_t idx = 0; idx < atoms.size(); ++idx)
+	// Only atoms within cutoff of the current tile of probes contribute.
+	vector<size_t> indices;
+	atoms_near(coord(beg), coord(array<size_t, 3>{{ end[0] - 1, end[1] - 1, end[2] - 1 }}), scoring_function::cutoff, indices);
+
+	for (const size_t idx : indices)
 	{
 		const auto& a = atoms[idx];
 		assert(!a.is_hydrogen());
-
-		const double dz = z_coord - a.coord[2];
-		const double dz_sqr = dz * dz;
-		const double dydx_sqr_ub = scoring_function::cutoff_sqr - dz_sqr;
-		if (dydx_sqr_ub <= 0)
-			continue;
-
-		const double dydx_ub = sqrt(dydx_sqr_ub);
-		const double y_lb = a.coord[1] - dydx_ub;
-		const double y_ub = a.coord[1] + dydx_ub;
-		const size_t y_beg = y_lb > corner0[1] ? (y_lb < corner1[1] ? static_cast<size_t>((y_lb - corner0[1]) * granularity_inverse)     : num_probes[1]) : 0;
-		const size_t y_end = y_ub > corner0[1] ? (y_ub < corner1[1] ? static_cast<size_t>((y_ub - corner0[1]) * granularity_inverse) + 1 : num_probes[1]) : 0;
 		const vector<size_t>& p = p_offset[a.xs];
-		size_t zy_offset = z_offset + num_probes[0] * y_beg;
-		double dy = corner0[1] + granularity * y_beg - a.coord[1];
 
-		for (size_t y = y_beg; y < y_end; ++y, zy_offset += num_probes[0], dy += granularity)
+		for (size_t z = beg[2]; z < end[2]; ++z)
 		{
-			const double dy_sqr = dy * dy;
-			const double dx_sqr_ub = dydx_sqr_ub - dy_sqr;
-			if (dx_sqr_ub <= 0)
+			const double dz = corner0[2] + granularity * z - a.coord[2];
+			const double dz_sqr = dz * dz;
+			const double dydx_sqr_ub = scoring_function::cutoff_sqr - dz_sqr;
+			if (dydx_sqr_ub <= 0)
 				continue;
 
-			const double dx_ub = sqrt(dx_sqr_ub);
-			const double x_lb = a.coord[0] - dx_ub;
-			const double x_ub = a.coord[0] + dx_ub;
-			const size_t x_beg = x_lb > corner0[0] ? (x_lb < corner1[0] ? static_cast<size_t>((x_lb - corner0[0]) * granularity_inverse)     : num_probes[0]) : 0;
-			const size_t x_end = x_ub > corner0[0] ? (x_ub < corner1[0] ? static_cast<size_t>((x_ub - corner0[0]) * granularity_inverse) + 1 : num_probes[0]) : 0;
-			const double dzdy_sqr = dz_sqr + dy_sqr;
-			size_t zyx_offset = zy_offset + x_beg;
-			double dx = corner0[0] + granularity * x_beg - a.coord[0];
+			const double dydx_ub = sqrt(dydx_sqr_ub);
+			const double y_lb = a.coord[1] - dydx_ub;
+			const double y_ub = a.coord[1] + dydx_ub;
+			const size_t y_beg = max(beg[1], y_lb > corner0[1] ? (y_lb < corner1[1] ? static_cast<size_t>((y_lb - corner0[1]) * granularity_inverse)     : num_probes[1]) : 0);
+			const size_t y_end = min(end[1], y_ub > corner0[1] ? (y_ub < corner1[1] ? static_cast<size_t>((y_ub - corner0[1]) * granularity_inverse) + 1 : num_probes[1]) : 0);
 
-			for (size_t x = x_beg; x < x_end; ++x, ++zyx_offset, dx += granularity)
+			for (size_t y = y_beg; y < y_end; ++y)
 			{
-				const double dx_sqr = dx * dx;
-				const double r2 = dzdy_sqr + dx_sqr;
-				if (r2 >= scoring_function::cutoff_sqr)
+				const double dy = corner0[1] + granularity * y - a.coord[1];
+				const double dy_sqr = dy * dy;
+				const double dx_sqr_ub = dydx_sqr_ub - dy_sqr;
+				if (dx_sqr_ub <= 0)
 					continue;
 
-				const size_t r_offset = static_cast<size_t>(sf.ns * r2);
+				const double dx_ub = sqrt(dx_sqr_ub);
+				const double x_lb = a.coord[0] - dx_ub;
+				const double x_ub = a.coord[0] + dx_ub;
+				const size_t x_beg = max(beg[0], x_lb > corner0[0] ? (x_lb < corner1[0] ? static_cast<size_t>((x_lb - corner0[0]) * granularity_inverse)     : num_probes[0]) : 0);
+				const size_t x_end = min(end[0], x_ub > corner0[0] ? (x_ub < corner1[0] ? static_cast<size_t>((x_ub - corner0[0]) * granularity_inverse) + 1 : num_probes[0]) : 0);
+				const double dzdy_sqr = dz_sqr + dy_sqr;
+				size_t zyx_offset = ext[0] * (ext[1] * (z - beg[2]) + (y - beg[1])) + (x_beg - beg[0]);
+
+				for (size_t x = x_beg; x < x_end; ++x, ++zyx_offset)
+				{
+					const double dx = corner0[0] + granularity * x - a.coord[0];
+					const double dx_sqr = dx * dx;
+					const double r2 = dzdy_sqr + dx_sqr;
+					if (r2 >= scoring_function::cutoff_sqr)
+						continue;
+
+					const size_t r_offset = static_cast<size_t>(sf.ns * r2);
+
+					for (size_t i = 0; i < n; ++i)
+					{
+						buffer[tile_probes * i + zyx_offset] += sf.e[p[i]][r_offset];
+					}
+				}
+			}
+		}
+	}
 
-				for (size_t i = 0; i < n; ++i)
+	// Copy rows of the tile buffer to the grid maps.
+	for (size_t i = 0; i < n; ++i)
+	{
+		const double* src = buffer.data() + tile_probes * i;
+		for (size_t z = beg[2]; z < end[2]; ++z)
+		{
+			for (size_t y = beg[1]; y < end[1]; ++y, src += ext[0])
+			{
+				fl* const map = map_buffers[xs[i]].data();
+				for (size_t x = 0; x < ext[0]; ++x)
 				{
-					maps[xs[i]][zyx_offset] += sf.e[p[i]][r_offset];
+					map[index(array<size_t, 3>{{ beg[0] + x, y, z }}) * map_stride] = static_cast<fl>(src[x]);
 				}
 			}
 		}
 	}
 }
+
+void receptor::differentiate(const vector<size_t>& xs, const size_t t)
+{
+	assert(gradient_maps);
+	assert(t < num_tiles[0] * num_tiles[1] * num_tiles[2]);
+
+	// Find the range of probes of the current tile.
+	const array<size_t, 3> tile
+	{{
+		t % num_tiles[0],
+		t / num_tiles[0] % num_tiles[1],
+		t / num_tiles[0] / num_tiles[1],
+	}};
+	array<size_t, 3> beg, end;
+	for (size_t i = 0; i < 3; ++i)
+	{
+		beg[i] = tile[i] * tile_size;
+		end[i] = min(beg[i] + tile_size, num_probes[i]);
+	}
+
+	// Save the forward differences next to the energy of every probe, which is how ligand::evaluate derives them without gradient maps.
+	// The probes on the upper boundaries are never the lower corner of a grid, so their derivatives are left zero.
+	for (const size_t i : xs)
+	{
+		fl* const map = map_buffers[i].data();
+		for (size_t z = beg[2]; z < end[2]; ++z)
+		{
+			for (size_t y = beg[1]; y < end[1]; ++y)
+			{
+				for (size_t x = beg[0]; x < end[0]; ++x)
+				{
+					fl* const r = map + index(array<size_t, 3>{{ x, y, z }}) * map_stride;
+					const double e000 = r[0];
+					r[1] = x + 1 < num_probes[0] ? static_cast<fl>((map[index(array<size_t, 3>{{ x + 1, y, z }}) * map_stride] - e000) * granularity_inverse) : 0;
+					r[2] = y + 1 < num_probes[1] ? static_cast<fl>((map[index(array<size_t, 3>{{ x, y + 1, z }}) * map_stride] - e000) * granularity_inverse) : 0;
+					r[3] = z + 1 < num_probes[2] ? static_cast<fl>((map[index(array<size_t, 3>{{ x, y, z + 1 }}) * map_stride] - e000) * granularity_inverse) : 0;
+				}
+			}
+		}
+	}
+}
+
+bool receptor::create_maps(const array<bool, scoring_function::n>& xs, const scoring_function& sf, task_scheduler& scheduler)
+{
+	assert(use_maps);
+
+	// Find atom types that are present in xs but not present in the grid maps.
+	vector<size_t> ts;
+	for (size_t t = 0; t < scoring_function::n; ++t)
+	{
+		if (xs[t] && init_e(t))
+		{
+			ts.push_back(t);
+		}
+	}
+	if (ts.empty())
+		return true;
+	thread_events[map_probes_populated] += ts.size() * num_probes_product;
+
+	// Precalculate p_offset.
+	precalculate(ts);
+
+	// Populate the grid map task container.
+	task_group tiles(scheduler);
+	for (size_t t = 0; t < num_tiles_product; ++t)
+	{
+		tiles.run([&, t]()
+			{
+				populate(ts, t, sf);
+			});
+	}
+	tiles.wait();
+
+	// Precalculate the gradients from the populated energies if requested.
+	if (gradient_maps)
+	{
+		for (size_t t = 0; t < num_tiles_product; ++t)
+		{
+			tiles.run([&, t]()
+				{
+					differentiate(ts, t);
+				});
+		}
+		tiles.wait();
+	}
+
+	// Save the new grid maps for later runs.
+	return cache_maps(ts);
+}
@@ -3,9 +3,15 @@
 #define IDOCK_RECEPTOR_HPP
 
 #include <filesystem>
+#include <istream>
+#include <memory>
+#include <cassert>
 #include "scoring_function.hpp"
+#include "cache_file.hpp"
+#include "aligned_allocator.hpp"
 #include "atom.hpp"
 #include "residue.hpp"
+#include "task_scheduler.hpp"
 using namespace std::filesystem;
 
 //! Represents a receptor.
@@ -13,27 +19,55 @@ class receptor
 {
 private:
 	vector<vector<size_t>> p_offset; //!< Auxiliary precalculated constants to accelerate grid map creation.
-	vector<vector<double>> maps; //!< Grid maps.
+	using map_buffer = vector<fl, aligned_allocator<fl, 4096>>; //!< Page-aligned grid map storage, so that the records of gradient maps never straddle cache lines.
+	vector<map_buffer> map_buffers; //!< Grid maps owned by this receptor, for atom types not backed by the cache file.
+	vector<const fl*> maps; //!< Grid maps, pointing to either an owned buffer or a block of the memory mapped cache file.
 	const array<double, 3> center; //!< Box center.
 	const array<double, 3> size; //!< 3D sizes of box.
+	uint64_t fingerprint; //!< Hash of the receptor file content and parsing options.
+	unique_ptr<cache_file> cache; //!< Grid map cache file, if any.
 
-	void parse_pdbqt(const path& p, bool remove_nonstd);
+	array<double, 3> cell_corner; //!< Corner of the atom cell grid with smallest values of all the 3 dimensions.
+	array<size_t, 3> num_cells; //!< Number of atom cells.
+	vector<size_t> cell_offsets; //!< Offsets into cell_atoms of every atom cell, with x being the lowest dimension and an extra ending offset.
+	vector<size_t> cell_atoms; //!< Atom indices in ascending order within every atom cell.
+
+	void parse_pdbqt(istream& is, bool remove_nonstd);
+
+	//! Buckets atoms into a uniform grid of cells for spatial queries.
+	void index_atoms();
 
 public:
 	//! Constructs a receptor by parsing a receptor file in pdbqt format.
 	explicit receptor(const path& p, bool remove_nonstd);
 
-	//! Constructs a receptor by parsing a receptor file in pdbqt format with a grid map for precalculation being created.
-	explicit receptor(const path& p, bool remove_nonstd, const array<double, 3>& center, const array<double, 3>& size, const double granularity);
+	//! Constructs a receptor by parsing a stream of pdbqt format.
+	explicit receptor(istream& is, bool remove_nonstd);
+
+	//! Constructs a receptor by parsing a receptor file in pdbqt format with a grid map for precalculation being created, optionally trilinearly interpolated, with precalculated gradients, in blocked layout, or backed by huge pages.
+	explicit receptor(const path& p, bool remove_nonstd, const array<double, 3>& center, const array<double, 3>& size, const double granularity, const bool trilinear, const bool gradient_maps, const bool blocked_maps, const bool huge_pages);
+
+	//! Constructs a receptor by parsing a stream of pdbqt format with a grid map for precalculation being created.
+	explicit receptor(istream& is, bool remove_nonstd, const array<double, 3>& center, const array<double, 3>& size, const double granularity, const bool trilinear, const bool gradient_maps, const bool blocked_maps, const bool huge_pages);
 
 	const bool use_maps; //!< Indicates if grid map precalculation is used.
+	const bool trilinear; //!< Indicates if grid maps are trilinearly interpolated rather than read at the lower corner of the containing grid.
+	const bool gradient_maps; //!< Indicates if every probe of grid maps stores its energy followed by its 3 precalculated partial derivatives.
+	const size_t map_stride; //!< Number of values stored per probe of grid maps, i.e. 4 with gradient maps or 1 otherwise.
+	const bool blocked_maps; //!< Indicates if grid maps are laid out in cubic blocks of probes rather than in rows, so that neighboring probes in all 3 dimensions are close in memory.
+	const bool huge_pages; //!< Indicates if grid maps owned by this receptor are advised to be backed by transparent huge pages.
 	const array<double, 3> corner0; //!< Box boundary corner with smallest values of all the 3 dimensions.
 	const array<double, 3> corner1; //!< Box boundary corner with largest values of all the 3 dimensions.
 	const double granularity; //!< 1D size of grids.
 	const double granularity_inverse; //!< 1 / granularity.
 	const array<size_t, 3> num_probes; //!< Number of probes.
 	const size_t num_probes_product; //!< Product of num_probes[0,1,2].
+	const array<size_t, 3> num_tiles; //!< Number of tiles of probes for grid map creation.
+	const size_t num_tiles_product; //!< Product of num_tiles[0,1,2].
+	const array<size_t, 3> num_blocks; //!< Number of blocks of probes in blocked layout.
+	const size_t map_size; //!< Number of values of a grid map, including the padding of blocks and the gradients if any.
 	vector<atom> atoms; //!< Receptor atoms.
+	array<bool, scoring_function::n> xs; //!< Presence of XScore atom types among the receptor atoms.
 	vector<residue> residues; //!< Receptor residues.
 
 	//! Returns free energy for the given atom type and atom coordinate using grid maps.
@@ -46,30 +80,119 @@ public:
 	inline double e(const size_t xs, const array<size_t, 3>& coord) const
 	{
 		assert(use_maps);
-		assert(maps[xs].size());
-		return maps[xs][index(coord)];
+		assert(maps[xs]);
+		return maps[xs][index(coord) * map_stride];
+	}
+
+	//! Returns the energy and the 3 precalculated partial derivatives for the given atom type and atom index using gradient maps. They share one cache line.
+	inline const fl* g(const size_t xs, const array<size_t, 3>& coord) const
+	{
+		assert(gradient_maps);
+		assert(maps[xs]);
+		return maps[xs] + index(coord) * map_stride;
 	}
 
-	//! Performs an initialization for the given atom type and returns true if an initialization has been performed.
-	inline bool init_e(const size_t xs)
+	//! Returns free energy for the given atom type and atom coordinate by trilinear interpolation of grid maps, and saves its exact gradient into d.
+	inline double e(const size_t xs, const array<double, 3>& coord, array<double, 3>& d) const
 	{
 		assert(use_maps);
-		if (!maps[xs].empty())
-			return false;
-		maps[xs].resize(num_probes_product);
-		return true;
+		assert(maps[xs]);
+		const auto idx = index(coord);
+		const size_t x0 = idx[0], x1 = x0 + 1;
+		const size_t y0 = idx[1], y1 = y0 + 1;
+		const size_t z0 = idx[2], z1 = z0 + 1;
+
+		// Read the 8 corners of the grid containing the coordinate. In row layout they lie at fixed strides from the lower corner, whereas in blocked layout they may straddle blocks and are indexed one by one.
+		double e000, e100, e010, e110, e001, e101, e011, e111;
+		if (!blocked_maps)
+		{
+			const size_t sx = map_stride, sy = num_probes[0] * sx, sz = num_probes[1] * sy;
+			const fl* const p = maps[xs] + index(idx) * map_stride;
+			e000 = p[0];
+			e100 = p[sx];
+			e010 = p[sy];
+			e110 = p[sy + sx];
+			e001 = p[sz];
+			e101 = p[sz + sx];
+			e011 = p[sz + sy];
+			e111 = p[sz + sy + sx];
+		}
+		else
+		{
+			e000 = e(xs, array<size_t, 3>{{ x0, y0, z0 }});
+			e100 = e(xs, array<size_t, 3>{{ x1, y0, z0 }});
+			e010 = e(xs, array<size_t, 3>{{ x0, y1, z0 }});
+			e110 = e(xs, array<size_t, 3>{{ x1, y1, z0 }});
+			e001 = e(xs, array<size_t, 3>{{ x0, y0, z1 }});
+			e101 = e(xs, array<size_t, 3>{{ x1, y0, z1 }});
+			e011 = e(xs, array<size_t, 3>{{ x0, y1, z1 }});
+			e111 = e(xs, array<size_t, 3>{{ x1, y1, z1 }});
+		}
+
+		// Interpolate along x, then y, then z, where (fx, fy, fz) is the fraction of the coordinate within the grid.
+		const double fx = (coord[0] - corner0[0]) * granularity_inverse - x0, gx = 1 - fx;
+		const double fy = (coord[1] - corner0[1]) * granularity_inverse - y0, gy = 1 - fy;
+		const double fz = (coord[2] - corner0[2]) * granularity_inverse - z0, gz = 1 - fz;
+		const double e00 = e000 * gx + e100 * fx;
+		const double e10 = e010 * gx + e110 * fx;
+		const double e01 = e001 * gx + e101 * fx;
+		const double e11 = e011 * gx + e111 * fx;
+		const double e0 = e00 * gy + e10 * fy;
+		const double e1 = e01 * gy + e11 * fy;
+		d[0] = (((e100 - e000) * gy + (e110 - e010) * fy) * gz + ((e101 - e001) * gy + (e111 - e011) * fy) * fz) * granularity_inverse;
+		d[1] = ((e10 - e00) * gz + (e11 - e01) * fz) * granularity_inverse;
+		d[2] = (e1 - e0) * granularity_inverse;
+		return e0 * gz + e1 * fz;
 	}
 
+	//! Performs an initialization for the given atom type and returns true if an initialization has been performed, i.e. the grid map is neither created nor cached.
+	bool init_e(const size_t xs);
+
+	//! Opens or creates the grid map cache file in the given folder, keyed by the receptor content, box and granularity.
+	void open_cache(const path& folder);
+
+	//! Appends newly populated grid maps to the cache file and releases their owned buffers. Returns false if the cache file cannot be written.
+	bool cache_maps(const vector<size_t>& xs);
+
+	static const size_t tile_size = 16; //!< 1D number of probes of a tile for grid map creation.
+	static const size_t block_size = 4; //!< 1D number of probes of a block in blocked layout. A block of double precision values spans 8 cache lines.
+	static const double cell_size; //!< 1D size of atom cells.
+
+	//! Collects in ascending order the indices of atoms whose distance to the axis-aligned box [lo, hi] is less than r. A point query is a box with lo == hi.
+	void atoms_near(const array<double, 3>& lo, const array<double, 3>& hi, const double r, vector<size_t>& indices) const;
+
 	//! Returns true if a coordinate is within current half-open-half-close box, i.e. [corner0, corner1).
-	bool within(const array<double, 3>& coord) const;
+	inline bool within(const array<double, 3>& coord) const
+	{
+		assert(use_maps);
+		return corner0[0] <= coord[0] && coord[0] < corner1[0]
+			&& corner0[1] <= coord[1] && coord[1] < corner1[1]
+			&& corner0[2] <= coord[2] && coord[2] < corner1[2];
+	}
 
 	//! Returns the index of the half-open-half-close grid containing the given coordinate.
-	array<size_t, 3> index(const array<double, 3>& coord) const;
+	inline array<size_t, 3> index(const array<double, 3>& coord) const
+	{
+		assert(use_maps);
+		return
+		{{
+			static_cast<size_t>((coord[0] - corner0[0]) * granularity_inverse),
+			static_cast<size_t>((coord[1] - corner0[1]) * granularity_inverse),
+			static_cast<size_t>((coord[2] - corner0[2]) * granularity_inverse),
+		}};
+	}
 
-	//! Reduces a 3D index to 1D with x being the lowest dimension.
-	size_t index(const array<size_t, 3>& idx) const;
+	//! Reduces a 3D index to 1D with x being the lowest dimension, either within rows or within blocks and then across blocks.
+	inline size_t index(const array<size_t, 3>& idx) const
+	{
+		assert(use_maps);
+		if (!blocked_maps)
+			return num_probes[0] * (num_probes[1] * idx[2] + idx[1]) + idx[0];
+		const size_t b = num_blocks[0] * (num_blocks[1] * (idx[2] / block_size) + idx[1] / block_size) + idx[0] / block_size;
+		return block_size * block_size * block_size * b + block_size * (block_size * (idx[2] % block_size) + idx[1] % block_size) + idx[0] % block_size;
+	}
 
-	//! Converts 1D index back to a 3D index with x being the lowest dimension.
+	//! Converts 1D index back to a 3D index with x being the lowest dimension, either within rows or within blocks and then across blocks.
 	array<size_t, 3> coord(const size_t index) const;
 
 	//! Returns the coordinate for the given index of the half-open-half-close grid.
@@ -78,8 +201,14 @@ public:
 	//! Precalculates auxiliary constants to accelerate grid map creation.
 	void precalculate(const vector<size_t>& xs);
 
-	//! Populates grid maps for certain atom types along X and Y dimensions for a given Z dimension value.
-	void populate(const vector<size_t>& xs, const size_t z, const scoring_function& sf);
+	//! Populates grid maps for certain atom types within a given tile of probes, where tiles are indexed with x being the lowest dimension.
+	void populate(const vector<size_t>& xs, const size_t t, const scoring_function& sf);
+
+	//! Precalculates the partial derivatives of gradient maps for certain atom types within a given tile of probes from the energies of their neighboring probes. All tiles must have been populated.
+	void differentiate(const vector<size_t>& xs, const size_t t);
+
+	//! Creates the grid maps of the atom types present in xs but neither created nor cached yet, running one task per tile, and caches them. Grid maps of other atom types remain readable meanwhile. Returns false if the new grid maps cannot be cached.
+	bool create_maps(const array<bool, scoring_function::n>& xs, const scoring_function& sf, task_scheduler& scheduler);
 };
 
 #endif
@@ -1,10 +1,13 @@
 #include <algorithm>
 #include "array.hpp"
 #include "result.hpp"
+#include "events.hpp"
 
 //! Clusters a result into a result container with a minimum RMSD requirement.
 void result::push(vector<result>& results, result&& r, const double required_square_error)
 {
+	++thread_events[result_pushes];
+
 	// If this is the first result, simply save it.
 	if (results.empty())
 	{
@@ -31,6 +34,7 @@ void result::push(vector<result>& results, result&& r, const double required_squ
 		// They are in the same cluster and r is better than results[index], so substitute r for results[index].
 		if (r.e < results[index].e)
 		{
+			++thread_events[result_replacements];
 			results[index] = move(r);
 		}
 	}
@@ -46,6 +50,7 @@ void result::push(vector<result>& results, result&& r, const double required_squ
 			// If r is better than the worst result, then substitute r for it.
 			if (r.e < results.back().e)
 			{
+				++thread_events[result_replacements];
 				results[results.size() - 1] = move(r);
 			}
 		}
@@ -1,8 +1,13 @@
 #include <cmath>
 #include <cassert>
+#include <sstream>
+#include <iomanip>
 #include "matrix.hpp"
+#include "hash.hpp"
 #include "scoring_function.hpp"
 
+const size_t scoring_function::n;
+const size_t scoring_function::np;
 const double scoring_function::cutoff_sqr = cutoff * cutoff;
 const array<double, scoring_function::n> scoring_function::vdw
 {{
@@ -57,9 +62,10 @@ inline bool is_hbond(const size_t t0, const size_t t1)
 }
 
 scoring_function::scoring_function()
-	: e(np, vector<double>(nr))
-	, d(np, vector<double>(nr))
+	: e(np)
+	, d(np)
 	, rs(nr)
+	, buffers(np)
 {
 	const double ns_inv = 1.0 / ns;
 	for (size_t i = 0; i < nr; ++i)
@@ -102,30 +108,115 @@ void scoring_function::score(double* const v, const size_t t0, const size_t t1,
 	v[4] += ((is_hbond(t0, t1)) ? ((d >= 0) ? 0.0 : ((d <= -0.7) ? 1 : d * (-1.4285714285714286))): 0.0);
 }
 
+uint64_t scoring_function::key()
+{
+	// The key covers everything that the values depend on. Bump the version whenever the formula changes.
+	const uint64_t version = 1;
+	uint64_t key = fnv1a(&version, sizeof(version));
+	key = fnv1a(vdw.data(), sizeof(vdw), key);
+	key = fnv1a(weights.data(), sizeof(weights), key);
+	const size_t params[3] = { ns, cutoff, sizeof(fl) };
+	return fnv1a(params, sizeof(params), key);
+}
+
+void scoring_function::open_cache(const path& folder)
+{
+	const uint64_t k = key();
+	ostringstream name;
+	name << hex << setw(16) << setfill('0') << k << ".sf";
+	cache = make_unique<cache_file>(folder / name.str(), k, np, sizeof(fl) * 2 * nr);
+}
+
 void scoring_function::precalculate(const size_t t0, const size_t t1)
 {
 	const size_t p = mr(t0, t1);
-	vector<double>& ep = e[p];
-	vector<double>& dp = d[p];
-	assert(ep.size() == nr);
-	assert(dp.size() == nr);
+	vector<fl>& buffer = buffers[p];
+	buffer.resize(2 * nr);
+	fl* const ep = buffer.data();
+	fl* const dp = ep + nr;
 
 	// Calculate the value of scoring function evaluated at (t0, t1, d).
+	// A double precision copy is kept to calculate the dor regardless of fl.
+	vector<double> es(nr);
 	for (size_t i = 0; i < nr; ++i)
 	{
-		ep[i] = score(t0, t1, rs[i]);
+		es[i] = score(t0, t1, rs[i]);
+		ep[i] = static_cast<fl>(es[i]);
 	}
 
 	// Calculate the dor of scoring function evaluated at (t0, t1, d).
 	for (size_t i = 1; i < nr - 1; ++i)
 	{
-		dp[i] = (ep[i + 1] - ep[i]) / ((rs[i + 1] - rs[i]) * rs[i]);
+		dp[i] = static_cast<fl>((es[i + 1] - es[i]) / ((rs[i + 1] - rs[i]) * rs[i]));
 	}
-	dp.front() = 0;
-	dp.back() = 0;
+	dp[0] = 0;
+	dp[nr - 1] = 0;
+	e[p] = ep;
+	d[p] = dp;
 }
 
-void scoring_function::clear()
+bool scoring_function::precalculate(const array<bool, n>& xs0, const array<bool, n>& xs1, task_scheduler& scheduler)
 {
-	rs.clear();
+	lock_guard<mutex> guard(precalculation_mutex);
+
+	// Find type combinations that are present but neither precalculated nor cached, each once regardless of order.
+	vector<array<size_t, 2>> pairs;
+	for (size_t t1 = 0; t1 < n; ++t1)
+		for (size_t t0 = 0; t0 <= t1; ++t0)
+		{
+			const size_t p = mr(t0, t1);
+			if (!((xs0[t0] && xs1[t1]) || (xs0[t1] && xs1[t0])) || e[p])
+				continue;
+
+			// Use the cached type combination if present.
+			if (cache)
+			{
+				if (const auto block = static_cast<const fl*>(cache->block(p)))
+				{
+					e[p] = block;
+					d[p] = block + nr;
+					continue;
+				}
+			}
+			pairs.push_back({{ t0, t1 }});
+		}
+	if (pairs.empty())
+		return true;
+
+	// Precalculate the new type combinations in parallel. Readers only index the combinations of their own types, so the other rows are not touched meanwhile.
+	task_group tasks(scheduler);
+	for (const auto& pair : pairs)
+	{
+		tasks.run([&, pair]()
+			{
+				precalculate(pair[0], pair[1]);
+			});
+	}
+	tasks.wait();
+
+	// Save the new type combinations for later runs.
+	if (!cache)
+		return true;
+	vector<pair<size_t, const void*>> blocks;
+	blocks.reserve(pairs.size());
+	for (const auto& pair : pairs)
+	{
+		const size_t p = mr(pair[0], pair[1]);
+		blocks.emplace_back(p, buffers[p].data());
+	}
+	if (!cache->append(blocks))
+		return false;
+
+	// Switch to the mapped blocks so that the owned buffers can be released.
+	for (const auto& block : blocks)
+	{
+		const size_t p = block.first;
+		if (const auto mapped = static_cast<const fl*>(cache->block(p)))
+		{
+			e[p] = mapped;
+			d[p] = mapped + nr;
+			vector<fl>().swap(buffers[p]);
+		}
+	}
+	return true;
 }
@@ -2,10 +2,21 @@
 #ifndef IDOCK_SCORING_FUNCTION_HPP
 #define IDOCK_SCORING_FUNCTION_HPP
 
+#include <cstdint>
 #include <vector>
 #include <array>
+#include <mutex>
+#include <memory>
+#include "task_scheduler.hpp"
+#include "cache_file.hpp"
 using namespace std;
 
+#ifdef IDOCK_FLOAT_MAPS
+using fl = float; //!< Value type of grid maps and scoring function tables, single precision to halve their memory footprint and bandwidth.
+#else
+using fl = double; //!< Value type of grid maps and scoring function tables.
+#endif
+
 //! Represents a scoring function.
 class scoring_function
 {
@@ -18,27 +29,39 @@ public:
 	static const double cutoff_sqr; //!< Cutoff square.
 	static const array<double, 5> weights; //!< Weight constants for 5 terms.
 
-	//! Constructs an empty scoring function.
+	//! Constructs an empty scoring function, whose type combinations are precalculated on demand.
 	explicit scoring_function();
 
+	scoring_function(const scoring_function&) = delete;
+	scoring_function& operator=(const scoring_function&) = delete;
+
 	//! Returns the score between two atoms of XScore atom types t0 and t1 with distance r.
 	static double score(const size_t t0, const size_t t1, const double r);
 
 	//! Accumulates the unweighted score between two atoms of XScore atom types t0 and t1 with square distance r2.
 	static void score(double* const v, const size_t t0, const size_t t1, const double r2);
 
+	//! Returns a hash of the formula version and the constants that the values depend on, which keys the files caching them or anything derived from them.
+	static uint64_t key();
+
+	//! Opens the cache file of type combinations in the given folder, keyed by the constants they depend on, so that processes sharing the folder map one copy instead of precalculating them.
+	void open_cache(const path& folder);
+
 	//! Precalculates the scoring function values of sample points for the type combination of t0 and t1.
 	void precalculate(const size_t t0, const size_t t1);
 
-	//! Clears precalculated values.
-	void clear();
+	//! Precalculates the type combinations of every type present in xs0 with every type present in xs1 that are neither precalculated nor cached yet, running one task per combination, and caches them. Combinations precalculated already remain readable meanwhile. Returns false if the new combinations cannot be cached.
+	bool precalculate(const array<bool, n>& xs0, const array<bool, n>& xs1, task_scheduler& scheduler);
 
-	vector<vector<double>> e; //!< Scoring function values.
-	vector<vector<double>> d; //!< Scoring function derivatives divided by distance.
+	vector<const fl*> e; //!< Scoring function values, pointing to either an owned buffer or a block of the memory mapped cache file, or nullptr for type combinations not precalculated yet.
+	vector<const fl*> d; //!< Scoring function derivatives divided by distance, following the values in the same buffer or block.
 
 private:
 	static const array<double, n> vdw; //!< Van der Waals distances for XScore atom types.
 	vector<double> rs; //!< Distance samples.
+	vector<vector<fl>> buffers; //!< Values followed by derivatives of the type combinations owned by this scoring function, for those not backed by the cache file.
+	unique_ptr<cache_file> cache; //!< Cache file of type combinations, if any.
+	mutex precalculation_mutex; //!< Mutex serializing the precalculation of type combinations on demand.
 };
 
 #endif
@@ -0,0 +1,63 @@
+#include <sstream>
+#include <iomanip>
+#include <boost/asio.hpp>
+#include "server.hpp"
+
+namespace asio = boost::asio;
+
+server::server(engine& eng) : eng(eng)
+{
+}
+
+void server::run(const string& endpoint)
+{
+	asio::io_context io;
+	if (!endpoint.empty() && all_of(endpoint.begin(), endpoint.end(), [](const char c) { return isdigit(c); }))
+	{
+		asio::ip::tcp::acceptor acceptor(io, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), static_cast<unsigned short>(stoul(endpoint))));
+		cout << "Listening on 127.0.0.1:" << endpoint << endl;
+		while (true)
+		{
+			asio::ip::tcp::iostream stream;
+			acceptor.accept(stream.socket());
+			serve(stream);
+		}
+	}
+	else
+	{
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+		// Remove the socket file left behind by a previous server.
+		remove(path(endpoint));
+		asio::local::stream_protocol::acceptor acceptor(io, asio::local::stream_protocol::endpoint(endpoint));
+		cout << "Listening on " << endpoint << endl;
+		while (true)
+		{
+			asio::local::stream_protocol::iostream stream;
+			acceptor.accept(stream.socket());
+			serve(stream);
+		}
+#else
+		throw runtime_error("Unix domain sockets are not supported on this platform, use a TCP port instead");
+#endif
+	}
+}
+
+void server::serve(iostream& stream)
+{
+	try
+	{
+		// Read the whole ligand, whose content also keys the seeds so that the same ligand is always docked the same way.
+		const string payload((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+		const auto results = eng.dock(payload, stream);
+		if (results.empty())
+			throw runtime_error("no conformation is found");
+		stream.flush();
+		cout << "Docked a ligand into " << results.size() << " conformations, idock score " << fixed << setprecision(2) << results.front().e_nd << " kcal/mol" << endl;
+	}
+	catch (const exception& e)
+	{
+		stream.clear();
+		stream << "ERROR: " << e.what() << endl;
+		cerr << "ERROR: " << e.what() << " in serving a connection" << endl;
+	}
+}
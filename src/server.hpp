@@ -0,0 +1,24 @@
+#pragma once
+#ifndef IDOCK_SERVER_HPP
+#define IDOCK_SERVER_HPP
+
+#include <iostream>
+#include "engine.hpp"
+
+//! Represents a docking server that keeps an engine in memory, and docks ligands received over a socket, one ligand per connection.
+class server
+{
+public:
+	//! Constructs a server that docks ligands with an engine, whose grid maps are created on demand and kept across connections.
+	explicit server(engine& eng);
+
+	//! Listens on an endpoint, being either a TCP port on the loopback interface or the path of a Unix domain socket, and serves connections one at a time until the process is terminated.
+	void run(const string& endpoint);
+private:
+	//! Reads a ligand in PDBQT format from a connection until the client shuts down its sending side, docks it, and writes back its conformations in PDBQT format, or a line starting with ERROR.
+	void serve(iostream& stream);
+
+	engine& eng; //!< Engine to dock the ligands.
+};
+
+#endif
@@ -0,0 +1,42 @@
+#include "stage_times.hpp"
+
+const array<string, num_stages> stage_times::names
+{{
+	"parsing_receptor",
+	"precalculating_scoring_function",
+	"training_random_forest",
+	"parsing_ligand",
+	"creating_maps",
+	"monte_carlo",
+	"clustering",
+	"rf_scoring",
+	"decomposing",
+	"writing_output",
+}};
+
+stage_times::stage_times()
+{
+	for (auto& t : *this)
+	{
+		t = 0;
+	}
+}
+
+void stage_times::add(const stage s, const stopwatch& sw)
+{
+	(*this)[s] += sw.elapsed();
+}
+
+stage_times& stage_times::operator+=(const stage_times& other)
+{
+	for (size_t s = 0; s < num_stages; ++s)
+	{
+		(*this)[s] += other[s];
+	}
+	return *this;
+}
+
+double stage_times::seconds(const stage s) const
+{
+	return (*this)[s] / 1e9;
+}
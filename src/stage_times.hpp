@@ -0,0 +1,46 @@
+#pragma once
+#ifndef IDOCK_STAGE_TIMES_HPP
+#define IDOCK_STAGE_TIMES_HPP
+
+#include <array>
+#include <atomic>
+#include <string>
+#include "stopwatch.hpp"
+using namespace std;
+
+//! Stages of a docking run that are timed separately. The first three are run once per run, and the others once per ligand.
+enum stage : size_t
+{
+	parsing_receptor,
+	precalculating_scoring_function,
+	training_random_forest,
+	parsing_ligand,
+	creating_maps,
+	monte_carlo,
+	clustering,
+	rf_scoring,
+	decomposing,
+	writing_output,
+	num_stages
+};
+
+//! Represents nanoseconds accumulated per stage. Stages run by several threads at once, e.g. Monte Carlo tasks, accumulate the time of every thread, so their sum may exceed the wall-clock time.
+class stage_times : public array<atomic<long long>, num_stages>
+{
+public:
+	static const array<string, num_stages> names; //!< Names of stages, used as column headers and keys.
+
+	//! Constructs zero times for all the stages.
+	explicit stage_times();
+
+	//! Adds the elapsed time of a stopwatch to a stage. This may be called concurrently.
+	void add(const stage s, const stopwatch& sw);
+
+	//! Adds the times of another set of stages.
+	stage_times& operator+=(const stage_times& other);
+
+	//! Returns the accumulated seconds of a stage.
+	double seconds(const stage s) const;
+};
+
+#endif
@@ -3,7 +3,9 @@
 #define IDOCK_STRING_HPP
 
 #include <string>
+#include <vector>
 #include <istream>
+#include <stdexcept>
 using namespace std;
 
 // Since C++17, copy elision is mandatory and no rvalue reference type or move is required on returning.
@@ -190,4 +192,82 @@ basic_istream<CharT, Traits>& safe_getline(basic_istream<CharT, Traits>& input,
 	}
 }
 
+//! Quote a string as a JSON string, escaping quotes, backslashes and control characters.
+inline string json_quote(const string& str)
+{
+	static const char hex[] = "0123456789abcdef";
+	string quoted = "\"";
+	for (const char c : str)
+	{
+		if (c == '"' || c == '\\')
+		{
+			quoted += '\\';
+			quoted += c;
+		}
+		else if (static_cast<unsigned char>(c) < 0x20)
+		{
+			quoted += "\\u00";
+			quoted += hex[c >> 4];
+			quoted += hex[c & 0xf];
+		}
+		else
+		{
+			quoted += c;
+		}
+	}
+	return quoted + '"';
+}
+
+//! Quote a CSV field in double quotes if it contains a comma, double quote or line break, doubling the double quotes within.
+inline string csv_quote(const string& str)
+{
+	if (str.find_first_of(",\"\r\n") == string::npos)
+		return str;
+	string quoted = "\"";
+	for (const char c : str)
+	{
+		if (c == '"')
+			quoted += '"';
+		quoted += c;
+	}
+	return quoted + '"';
+}
+
+//! Split a CSV line into fields, unquoting those quoted by csv_quote. Throws invalid_argument if a quote is unterminated or followed by other than a comma.
+inline vector<string> csv_split(const string& line)
+{
+	vector<string> fields(1);
+	for (size_t i = 0; i < line.size(); ++i)
+	{
+		const char c = line[i];
+		if (c == ',')
+		{
+			fields.emplace_back();
+		}
+		else if (c == '"' && fields.back().empty())
+		{
+			for (++i;; ++i)
+			{
+				if (i == line.size())
+					throw invalid_argument("unterminated quote in " + line);
+				if (line[i] == '"')
+				{
+					if (i + 1 < line.size() && line[i + 1] == '"')
+						++i;
+					else
+						break;
+				}
+				fields.back() += line[i];
+			}
+			if (i + 1 < line.size() && line[i + 1] != ',')
+				throw invalid_argument("text after quote in " + line);
+		}
+		else
+		{
+			fields.back() += c;
+		}
+	}
+	return fields;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,161 @@
+#include "task_scheduler.hpp"
+
+//! Scheduler of the calling worker thread, or null for other threads.
+static thread_local task_scheduler* current_scheduler = nullptr;
+
+//! Index of the calling worker thread within its scheduler.
+static thread_local size_t current_worker = 0;
+
+task_scheduler::task_scheduler(const size_t num_threads) : num_queued(0), next(0), stopping(false)
+{
+	workers.reserve(num_threads);
+	for (size_t w = 0; w < num_threads; ++w)
+	{
+		workers.push_back(make_unique<worker>());
+	}
+	threads.reserve(num_threads);
+	for (size_t w = 0; w < num_threads; ++w)
+	{
+		threads.emplace_back([this, w]()
+		{
+			work(w);
+		});
+	}
+}
+
+task_scheduler::~task_scheduler()
+{
+	{
+		lock_guard<mutex> guard(m);
+		stopping = true;
+	}
+	cv.notify_all();
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+}
+
+void task_scheduler::push(function<void()>&& task)
+{
+	const size_t w = current_scheduler == this ? current_worker : next++ % workers.size();
+	{
+		lock_guard<mutex> guard(workers[w]->m);
+		workers[w]->tasks.push_back(move(task));
+	}
+	{
+		lock_guard<mutex> guard(m);
+		++num_queued;
+	}
+	cv.notify_one();
+}
+
+bool task_scheduler::try_run()
+{
+	const size_t num_workers = workers.size();
+	const bool own = current_scheduler == this;
+	const size_t self = own ? current_worker : 0;
+	function<void()> task;
+	for (size_t i = 0; i < num_workers && !task; ++i)
+	{
+		worker& victim = *workers[(self + i) % num_workers];
+		lock_guard<mutex> guard(victim.m);
+		if (victim.tasks.empty()) continue;
+
+		// Run the newest task of the own deque for locality, and steal the oldest task of others as it likely spawns the most work.
+		if (own && !i)
+		{
+			task = move(victim.tasks.back());
+			victim.tasks.pop_back();
+		}
+		else
+		{
+			task = move(victim.tasks.front());
+			victim.tasks.pop_front();
+		}
+	}
+	if (!task)
+		return false;
+	--num_queued;
+	task();
+	return true;
+}
+
+void task_scheduler::notify()
+{
+	{
+		lock_guard<mutex> guard(m);
+	}
+	cv.notify_all();
+}
+
+void task_scheduler::work(const size_t w)
+{
+	current_scheduler = this;
+	current_worker = w;
+	while (true)
+	{
+		if (try_run()) continue;
+		unique_lock<mutex> lock(m);
+		cv.wait(lock, [this]() { return stopping || num_queued; });
+		if (stopping && !num_queued)
+			return;
+	}
+}
+
+task_group::task_group(task_scheduler& scheduler) : scheduler(scheduler), num_pending(0)
+{
+}
+
+task_group::~task_group()
+{
+	try
+	{
+		wait();
+	}
+	catch (...)
+	{
+	}
+}
+
+void task_group::run(function<void()> task)
+{
+	++num_pending;
+	scheduler.push([this, task = move(task)]()
+	{
+		try
+		{
+			task();
+		}
+		catch (...)
+		{
+			lock_guard<mutex> guard(m);
+			if (!error) error = current_exception();
+		}
+		// The group may be destroyed as soon as the counter reaches zero, so only the scheduler is touched afterwards.
+		task_scheduler& s = scheduler;
+		if (--num_pending == 0)
+		{
+			s.notify();
+		}
+	});
+}
+
+void task_group::wait()
+{
+	// Worker threads help run queued tasks rather than block, so that tasks waiting on nested groups do not starve the workers.
+	// Other threads block, so that the time they wait, e.g. timed as a stage of a ligand, is not spent on tasks of other groups. They help only if there are no workers.
+	const bool help = current_scheduler == &scheduler || scheduler.workers.empty();
+	while (num_pending)
+	{
+		if (help && scheduler.try_run()) continue;
+		unique_lock<mutex> lock(scheduler.m);
+		scheduler.cv.wait(lock, [this, help]() { return !num_pending || (help && scheduler.num_queued); });
+	}
+	if (error)
+	{
+		exception_ptr e;
+		swap(e, error);
+		rethrow_exception(e);
+	}
+}
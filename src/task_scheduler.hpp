@@ -0,0 +1,84 @@
+#pragma once
+#ifndef IDOCK_TASK_SCHEDULER_HPP
+#define IDOCK_TASK_SCHEDULER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std;
+
+//! Represents a pool of worker threads, each owning a deque of tasks. A worker pops its own tasks in LIFO order, and steals the oldest tasks of other workers when its own deque is empty.
+class task_scheduler
+{
+public:
+	//! Creates a number of worker threads.
+	explicit task_scheduler(const size_t num_threads);
+
+	//! Runs the remaining tasks and joins the worker threads.
+	~task_scheduler();
+
+	task_scheduler(const task_scheduler&) = delete;
+	task_scheduler& operator=(const task_scheduler&) = delete;
+private:
+	friend class task_group;
+
+	//! Represents the deque of tasks of a worker thread.
+	class worker
+	{
+	public:
+		mutex m; //!< Mutex guarding the deque.
+		deque<function<void()>> tasks; //!< Queued tasks.
+	};
+
+	//! Queues a task onto the deque of the calling worker thread, or onto the deques in a round robin manner if called by another thread.
+	void push(function<void()>&& task);
+
+	//! Runs a queued task, preferring the deque of the calling worker thread. Returns false if all deques are empty.
+	bool try_run();
+
+	//! Wakes up the threads waiting for tasks or task groups.
+	void notify();
+
+	//! Runs tasks until there are no more tasks and the scheduler is being destroyed.
+	void work(const size_t w);
+
+	vector<unique_ptr<worker>> workers; //!< Per worker deques.
+	vector<thread> threads; //!< Worker threads.
+	mutex m; //!< Mutex guarding idle waits.
+	condition_variable cv; //!< Signaled when a task is queued or a task group finishes.
+	atomic<size_t> num_queued; //!< Number of queued tasks across all deques.
+	atomic<size_t> next; //!< Next deque to push onto from a non worker thread.
+	bool stopping; //!< Whether the scheduler is being destroyed.
+};
+
+//! Represents a group of tasks that is waited on as a whole. Groups are independent of each other, and a task may create and wait on a nested group.
+class task_group
+{
+public:
+	//! Creates an empty group of tasks to be run by a scheduler.
+	explicit task_group(task_scheduler& scheduler);
+
+	//! Waits for the remaining tasks, discarding their exceptions.
+	~task_group();
+
+	task_group(const task_group&) = delete;
+	task_group& operator=(const task_group&) = delete;
+
+	//! Queues a task into the group.
+	void run(function<void()> task);
+
+	//! Waits until all the tasks of the group have finished, and rethrows the first exception thrown by the tasks if any. A worker thread runs queued tasks meanwhile, and another thread blocks.
+	void wait();
+private:
+	task_scheduler& scheduler; //!< Scheduler to run the tasks.
+	atomic<size_t> num_pending; //!< Number of tasks not yet finished.
+	mutex m; //!< Mutex guarding the exception.
+	exception_ptr error; //!< First exception thrown by the tasks.
+};
+
+#endif
@@ -0,0 +1,147 @@
+#include <iostream>
+#include <random>
+#include "../src/receptor.hpp"
+#include "../src/ligand.hpp"
+#include "../src/pka.hpp"
+#include "../src/array.hpp"
+using namespace std;
+using namespace std::filesystem;
+
+//! Returns true if two values agree within a relative tolerance, as sums of the same terms in different orders do.
+static bool close(const double a, const double b)
+{
+	return abs(a - b) <= 1e-9 * max(1.0, max(abs(a), abs(b)));
+}
+
+//! Checks that the incremental evaluation of random torsion mutations agrees with the full evaluation in energy, force and change, in every grid map layout. Mutations are accepted at random, so that the workspaces are restored after both rejected and accepted mutations the way Monte Carlo tasks do.
+//! Usage: incremental_evaluate receptor.pdbqt ligand.pdbqt ... center_x center_y center_z size_x size_y size_z
+int main(int argc, char* argv[])
+{
+	if (argc < 9)
+	{
+		cerr << "Usage: incremental_evaluate receptor.pdbqt ligand.pdbqt ... center_x center_y center_z size_x size_y size_z" << endl;
+		return 1;
+	}
+	const path receptor_path = argv[1];
+	const vector<path> ligand_paths(argv + 2, argv + argc - 6);
+	const array<double, 3> center{{ stod(argv[argc - 6]), stod(argv[argc - 5]), stod(argv[argc - 4]) }};
+	const array<double, 3> size{{ stod(argv[argc - 3]), stod(argv[argc - 2]), stod(argv[argc - 1]) }};
+
+	size_t num_comparisons = 0, num_mismatches = 0;
+	scoring_function sf;
+	for (size_t t1 = 0; t1 < scoring_function::n; ++t1)
+		for (size_t t0 = 0; t0 <= t1; ++t0)
+		{
+			sf.precalculate(t0, t1);
+		}
+	for (const auto layout : { "rows", "trilinear", "gradient_maps", "blocked_maps" })
+	{
+		const bool trilinear = layout == string("trilinear"), gradient_maps = layout == string("gradient_maps"), blocked_maps = layout == string("blocked_maps");
+		receptor rec(receptor_path, false, center, size, 0.375, trilinear, gradient_maps, blocked_maps, false);
+		for (const auto& ligand_path : ligand_paths)
+		{
+			array<double, 3> origin;
+			const ligand lig(ligand_path, origin, pka(), 7.4);
+			if (!lig.num_active_torsions)
+			{
+				cerr << ligand_path << " has no active torsions" << endl;
+				return 1;
+			}
+
+			// Populate the grid maps of the atom types of the ligand not populated for a previous one.
+			vector<size_t> xs;
+			for (size_t t = 0; t < scoring_function::n; ++t)
+			{
+				if (lig.xs[t] && rec.init_e(t))
+				{
+					xs.push_back(t);
+				}
+			}
+			rec.precalculate(xs);
+			for (size_t t = 0; t < rec.num_tiles_product; ++t)
+			{
+				rec.populate(xs, t, sf);
+			}
+			if (gradient_maps)
+			{
+				for (size_t t = 0; t < rec.num_tiles_product; ++t)
+				{
+					rec.differentiate(xs, t);
+				}
+			}
+
+			// Find a conformation within the box, without an upper bound so that every evaluation runs to completion.
+			mt19937_64 rng(ligand_path.stem().string().size());
+			uniform_real_distribution<double> u01(0, 1);
+			uniform_real_distribution<double> upi(-3.1415926535897932, 3.1415926535897932);
+			uniform_int_distribution<size_t> ut(0, lig.num_active_torsions - 1);
+			normal_distribution<double> n01(0, 1);
+			const double e_upper_bound = numeric_limits<double>::max();
+			conformation c0(lig.num_active_torsions), c1(lig.num_active_torsions);
+			double e0, f0, e1, f1, e2, f2;
+			change g0(lig.num_active_torsions), g1(lig.num_active_torsions), g2(lig.num_active_torsions);
+			workspace w0 = lig.create_workspace(), wm = lig.create_workspace(), w = lig.create_workspace();
+			bool valid_conformation = false;
+			for (size_t i = 0; i < 1000 && !valid_conformation; ++i)
+			{
+				for (size_t d = 0; d < 3; ++d)
+				{
+					c0.position[d] = center[d] + (u01(rng) - 0.5) * 0.5 * size[d];
+				}
+				c0.orientation = normalize(array<double, 4>{{ n01(rng), n01(rng), n01(rng), n01(rng) }});
+				for (auto& torsion : c0.torsions)
+				{
+					torsion = upi(rng);
+				}
+				valid_conformation = lig.evaluate(c0, sf, rec, e_upper_bound, e0, f0, g0, w0);
+			}
+			if (!valid_conformation)
+			{
+				cerr << "No conformation of " << ligand_path << " fits in the box" << endl;
+				return 1;
+			}
+
+			// Mutate a random torsion of c0, and compare its incremental evaluation from w0 with its full evaluation.
+			size_t wm_torsion = SIZE_MAX;
+			for (size_t i = 0; i < 1000; ++i)
+			{
+				const size_t t = ut(rng);
+				c1 = c0;
+				c1.torsions[t] = upi(rng);
+				if (wm_torsion == SIZE_MAX)
+					wm = w0;
+				else
+					lig.restore(wm, w0, wm_torsion);
+				wm_torsion = t;
+				const bool incremental = lig.evaluate(c1, sf, rec, e_upper_bound, e1, f1, g1, wm, w0, t);
+				const bool full = lig.evaluate(c1, sf, rec, e_upper_bound, e2, f2, g2, w);
+				++num_comparisons;
+				bool match = incremental == full;
+				if (match && full)
+				{
+					match = close(e1, e2) && close(f1, f2);
+					for (size_t j = 0; j < g1.size(); ++j)
+					{
+						match = match && close(g1[j], g2[j]);
+					}
+				}
+				if (!match)
+				{
+					cerr << "MISMATCH: " << ligand_path << " in " << layout << " layout, mutation " << i << " of torsion " << t << ": incremental e = " << e1 << ", f = " << f1 << ", full e = " << e2 << ", f = " << f2 << endl;
+					++num_mismatches;
+					continue;
+				}
+
+				// Accept a fitting mutation at random, so that later mutations start from a different conformation.
+				if (full && u01(rng) < 0.2)
+				{
+					c0 = c1;
+					w0 = w;
+					wm_torsion = SIZE_MAX;
+				}
+			}
+		}
+	}
+	cout << "Compared " << num_comparisons << " incremental evaluations, " << num_mismatches << " mismatched" << endl;
+	return num_mismatches ? 1 : 0;
+}
@@ -0,0 +1,28 @@
+# Scores a ligand of an example complex with coarse grid maps, and checks that the evaluations of scoring are counted per ligand and per run.
+# Usage: cmake -DJDOCK=<jdock> -DEXAMPLE=<example folder> -DLIGAND=<ligand file> -DOUT=<output folder> -P score_only_events.cmake
+file(REMOVE_RECURSE ${OUT})
+execute_process(
+  COMMAND ${JDOCK} --config idock.conf --ligand ${LIGAND} --out ${OUT} --granularity 1 --score_only --ligand_events
+  WORKING_DIRECTORY ${EXAMPLE}
+  RESULT_VARIABLE status
+  OUTPUT_QUIET
+)
+if(NOT status EQUAL 0)
+  message(FATAL_ERROR "jdock exited with status ${status}")
+endif()
+
+file(GLOB summaries ${OUT}/*.json)
+file(GLOB ligand_events ${OUT}/*_events.jsonl)
+if(NOT summaries OR NOT ligand_events)
+  message(FATAL_ERROR "jdock wrote no JSON summary or ligand events in ${OUT}")
+endif()
+file(READ ${summaries} summary)
+if(NOT summary MATCHES "\"evaluations\": [1-9]")
+  message(FATAL_ERROR "the JSON summary counts no evaluations:\n${summary}")
+endif()
+file(STRINGS ${ligand_events} lines)
+foreach(line IN LISTS lines)
+  if(NOT line MATCHES "\"evaluations\": [1-9]")
+    message(FATAL_ERROR "a ligand counts no evaluations: ${line}")
+  endif()
+endforeach()
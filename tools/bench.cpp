@@ -0,0 +1,440 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <functional>
+#include <random>
+#include <boost/program_options.hpp>
+#include "../src/receptor.hpp"
+#include "../src/ligand.hpp"
+#include "../src/random_forest.hpp"
+#include "../src/stopwatch.hpp"
+#include "../src/pka.hpp"
+#include "../src/string.hpp"
+#include "../src/array.hpp"
+#include "../src/events.hpp"
+using namespace std;
+using namespace std::filesystem;
+
+//! Represents the timings of a kernel, in nanoseconds per operation for every repetition.
+class kernel
+{
+public:
+	string name; //!< Name of the kernel.
+	size_t num_ops; //!< Number of operations per repetition.
+	vector<double> ns; //!< Nanoseconds per operation of every repetition.
+	array<uint64_t, num_events> events{}; //!< Events counted over all the timed repetitions.
+
+	explicit kernel(const string& name, const size_t num_ops) : name(name), num_ops(num_ops)
+	{
+	}
+
+	//! Returns the p-th percentile by the nearest rank method.
+	double percentile(const double p) const
+	{
+		vector<double> sorted(ns);
+		sort(sorted.begin(), sorted.end());
+		const size_t rank = static_cast<size_t>(ceil(p / 100 * sorted.size()));
+		return sorted[rank ? rank - 1 : 0];
+	}
+};
+
+int main(int argc, char* argv[])
+{
+	path receptor_path, ligand_path, out_path;
+	array<double, 3> center, size;
+	double granularity;
+	size_t num_warmups, num_repetitions, num_trees, seed;
+	bool trilinear, gradient_maps, blocked_maps, huge_pages;
+
+	// Process program options.
+	try
+	{
+		using namespace boost::program_options;
+		options_description options("jdock_bench times the hot kernels of jdock in isolation on a single thread.\nUsage: jdock_bench [options]\noptions");
+		options.add_options()
+			("receptor,r", value<path>(&receptor_path)->default_value("receptors/1AQ1.pdbqt"), "receptor file in PDBQT format")
+			("ligand,l", value<path>(&ligand_path)->default_value("ligands/ZINC/ZINC00968327.pdbqt"), "ligand file in PDBQT format")
+			("center_x,x", value<double>(&center[0])->default_value(0.326), "x coordinate of the search space center")
+			("center_y,y", value<double>(&center[1])->default_value(26.958), "y coordinate of the search space center")
+			("center_z,z", value<double>(&center[2])->default_value(9.102), "z coordinate of the search space center")
+			("size_x", value<double>(&size[0])->default_value(20.409), "size in the x dimension in Angstrom")
+			("size_y", value<double>(&size[1])->default_value(20.941), "size in the y dimension in Angstrom")
+			("size_z", value<double>(&size[2])->default_value(18.476), "size in the z dimension in Angstrom")
+			("granularity,G", value<double>(&granularity)->default_value(0.125), "density of probe atoms of grid maps")
+			("warmups", value<size_t>(&num_warmups)->default_value(2), "number of untimed repetitions before timing a kernel")
+			("repetitions", value<size_t>(&num_repetitions)->default_value(10), "number of timed repetitions of a kernel")
+			("trees", value<size_t>(&num_trees)->default_value(20), "number of decision trees trained per repetition, which then compute RF-Score")
+			("seed", value<size_t>(&seed)->default_value(1), "random seed of Monte Carlo searches and random forests")
+			("trilinear", bool_switch(&trilinear), "trilinearly interpolate grid maps, to be compared with the default of reading the lower corner")
+			("gradient_maps", bool_switch(&gradient_maps), "store precalculated gradients next to energies in grid maps")
+			("blocked_maps", bool_switch(&blocked_maps), "lay out grid maps in 4x4x4 blocks of probes")
+			("huge_pages", bool_switch(&huge_pages), "advise the kernel to back grid maps with transparent huge pages, Linux only")
+			("out,o", value<path>(&out_path), "JSON report, written to the standard output if omitted")
+			("help", "this help information")
+			;
+
+		variables_map vm;
+		store(parse_command_line(argc, argv, options), vm);
+		if (vm.count("help"))
+		{
+			cout << options;
+			return 0;
+		}
+		vm.notify();
+
+		if (!exists(receptor_path))
+		{
+			cerr << "Option receptor " << receptor_path << " does not exist" << endl;
+			return 1;
+		}
+		if (!exists(ligand_path))
+		{
+			cerr << "Option ligand " << ligand_path << " does not exist" << endl;
+			return 1;
+		}
+		if (!num_repetitions)
+		{
+			cerr << "Option repetitions must be 1 or greater" << endl;
+			return 1;
+		}
+		if (!num_trees)
+		{
+			cerr << "Option trees must be 1 or greater" << endl;
+			return 1;
+		}
+		if (granularity <= 0)
+		{
+			cerr << "Option granularity must be positive" << endl;
+			return 1;
+		}
+	}
+	catch (const exception& e)
+	{
+		cerr << "ERROR: " << e.what() << endl;
+		return 1;
+	}
+
+	try
+	{
+		vector<kernel> kernels;
+
+		// Times a kernel of num_ops operations. The setup runs before every repetition and is not timed.
+		const auto bench = [&](const string& name, const size_t num_ops, const function<void()>& setup, const function<void()>& body)
+		{
+			cerr << "Timing " << name << endl;
+			kernels.emplace_back(name, num_ops);
+			for (size_t i = 0; i < num_warmups + num_repetitions; ++i)
+			{
+				setup();
+				const auto before = thread_events;
+				const auto sw = stopwatch::start_new();
+				body();
+				if (i >= num_warmups)
+				{
+					auto& k = kernels.back();
+					k.ns.push_back(static_cast<double>(sw.elapsed()) / num_ops);
+					for (size_t e = 0; e < num_events; ++e)
+					{
+						k.events[e] += thread_events[e] - before[e];
+					}
+				}
+			}
+		};
+		const auto no_setup = []()
+		{
+		};
+
+		// Parse the receptor and the ligand.
+		bench("parse_receptor", 1, no_setup, [&]()
+		{
+			receptor(receptor_path, false, center, size, granularity, trilinear, gradient_maps, blocked_maps, huge_pages);
+		});
+		receptor rec(receptor_path, false, center, size, granularity, trilinear, gradient_maps, blocked_maps, huge_pages);
+		array<double, 3> origin;
+		bench("parse_ligand", 100, no_setup, [&]()
+		{
+			for (size_t i = 0; i < 100; ++i)
+			{
+				ligand(ligand_path, origin, pka(), 7.4);
+			}
+		});
+		const ligand lig(ligand_path, origin, pka(), 7.4);
+
+		// Precalculate the scoring function of all the atom type pairs.
+		scoring_function sf;
+		bench("scoring_function_precalculate", scoring_function::np, no_setup, [&]()
+		{
+			for (size_t t1 = 0; t1 < scoring_function::n; ++t1)
+				for (size_t t0 = 0; t0 <= t1; ++t0)
+				{
+					sf.precalculate(t0, t1);
+				}
+		});
+
+		// Populate the grid maps of the ligand atom types tile by tile, sampling tiles evenly across the box. All the tiles are populated once beforehand for the other kernels.
+		vector<size_t> ts;
+		for (size_t t = 0; t < scoring_function::n; ++t)
+		{
+			if (lig.xs[t] && rec.init_e(t))
+			{
+				ts.push_back(t);
+			}
+		}
+		rec.precalculate(ts);
+		for (size_t t = 0; t < rec.num_tiles_product; ++t)
+		{
+			rec.populate(ts, t, sf);
+		}
+		if (gradient_maps)
+		{
+			for (size_t t = 0; t < rec.num_tiles_product; ++t)
+			{
+				rec.differentiate(ts, t);
+			}
+		}
+		const size_t num_sampled_tiles = min<size_t>(64, rec.num_tiles_product);
+		bench("receptor_populate_tile", num_sampled_tiles, no_setup, [&]()
+		{
+			for (size_t i = 0; i < num_sampled_tiles; ++i)
+			{
+				rec.populate(ts, i * rec.num_tiles_product / num_sampled_tiles, sf);
+			}
+		});
+
+		// Evaluate a random conformation within the box without an upper bound, so that every evaluation runs to completion.
+		{
+			mt19937_64 rng(seed);
+			uniform_real_distribution<double> upi(-3.1415926535897932, 3.1415926535897932);
+			normal_distribution<double> n01(0, 1);
+			conformation c0(lig.num_active_torsions);
+			double e0, f0;
+			change g0(lig.num_active_torsions);
+			workspace w0 = lig.create_workspace();
+			bool valid_conformation = false;
+			for (size_t i = 0; i < 1000 && !valid_conformation; ++i)
+			{
+				for (size_t d = 0; d < 3; ++d)
+				{
+					c0.position[d] = uniform_real_distribution<double>(rec.corner0[d], rec.corner1[d])(rng);
+				}
+				c0.orientation = normalize(array<double, 4>{{n01(rng), n01(rng), n01(rng), n01(rng)}});
+				for (auto& torsion : c0.torsions)
+				{
+					torsion = upi(rng);
+				}
+				valid_conformation = lig.evaluate(c0, sf, rec, numeric_limits<double>::max(), e0, f0, g0, w0);
+			}
+			if (!valid_conformation)
+				throw runtime_error("no conformation of the ligand fits in the box");
+			bench("ligand_evaluate", 1000, no_setup, [&]()
+			{
+				for (size_t i = 0; i < 1000; ++i)
+				{
+					lig.evaluate(c0, sf, rec, numeric_limits<double>::max(), e0, f0, g0, w0);
+				}
+			});
+		}
+
+		// Run Monte Carlo tasks, each being 100 steps per heavy atom of a mutation followed by a BFGS local search to a local minimum. Events per operation are thus per converged local minimum.
+		vector<result> pool;
+		size_t k = 0;
+		{
+			const size_t num_steps = 100 * lig.num_heavy_atoms;
+			vector<result> results;
+			bench("bfgs_local_search", num_steps, [&]()
+			{
+				results.clear();
+				results.reserve(20); // Maximum number of results obtained from a single Monte Carlo task.
+			}, [&]()
+			{
+				lig.monte_carlo(results, seed + k++, sf, rec);
+			});
+			pool = results;
+		}
+		if (pool.empty())
+			throw runtime_error("no conformation is found");
+
+		// Read the energies and derivatives of the heavy atoms of the poses found above from the grid maps, the way ligand::evaluate does in the configured layout.
+		{
+			vector<pair<size_t, array<double, 3>>> lookups;
+			for (const auto& r : pool)
+			{
+				for (size_t i = 0; i < r.heavy_atoms.size(); ++i)
+				{
+					lookups.emplace_back(lig.heavy_xs[i], r.heavy_atoms[i]);
+				}
+			}
+			double sum = 0;
+			bench("receptor_lookup", lookups.size(), no_setup, [&]()
+			{
+				for (const auto& l : lookups)
+				{
+					const size_t xs = l.first;
+					if (trilinear)
+					{
+						array<double, 3> d;
+						sum += rec.e(xs, l.second, d) + d[0] + d[1] + d[2];
+						continue;
+					}
+					const auto index = rec.index(l.second);
+					if (gradient_maps)
+					{
+						const fl* const g = rec.g(xs, index);
+						sum += g[0] + g[1] + g[2] + g[3];
+						continue;
+					}
+					sum += rec.e(xs, index)
+						+ rec.e(xs, array<size_t, 3>{{ index[0] + 1, index[1], index[2] }})
+						+ rec.e(xs, array<size_t, 3>{{ index[0], index[1] + 1, index[2] }})
+						+ rec.e(xs, array<size_t, 3>{{ index[0], index[1], index[2] + 1 }});
+				}
+			});
+			if (!isfinite(sum))
+				cerr << "Looked up a non-finite energy" << endl;
+		}
+
+		// Push results into a container full of 9 conformations, the default maximum. The container is restored before every repetition.
+		{
+			const size_t num_ops = 1000;
+			const size_t max_conformations = 9;
+			const double required_square_error = static_cast<double>(4 * lig.num_heavy_atoms);
+			vector<result> results, candidates;
+
+			// Fill the container with distinct conformations, i.e. of different clusters, running further Monte Carlo tasks if the poses found above are too few.
+			vector<result> full;
+			full.reserve(max_conformations);
+			for (const auto& r : pool)
+			{
+				result::push(full, result(r), required_square_error);
+			}
+			for (size_t t = 0; full.size() < max_conformations && t < 100; ++t)
+			{
+				results.clear();
+				results.reserve(20);
+				lig.monte_carlo(results, seed + k++, sf, rec);
+				for (auto& r : results)
+				{
+					result::push(full, move(r), required_square_error);
+				}
+			}
+			if (full.size() < max_conformations)
+				throw runtime_error("fewer than " + to_string(max_conformations) + " distinct conformations are found");
+			bench("result_push_full", num_ops, [&]()
+			{
+				vector<result>().swap(results);
+				results.reserve(max_conformations);
+				results = full;
+				candidates.clear();
+				for (size_t i = 0; i < num_ops; ++i)
+				{
+					candidates.push_back(pool[i % pool.size()]);
+				}
+			}, [&]()
+			{
+				for (auto& r : candidates)
+				{
+					result::push(results, move(r), required_square_error);
+				}
+			});
+		}
+
+		// Train decision trees, and compute RF-Score with the trees trained last.
+		unique_ptr<forest> f;
+		bench("tree_train", num_trees, [&]()
+		{
+			f = make_unique<forest>(num_trees, seed);
+		}, [&]()
+		{
+			for (size_t i = 0; i < num_trees; ++i)
+			{
+				(*f)[i].train(8, f->u01_s);
+			}
+		});
+		f->clear();
+		bench("ligand_calculate_rf_score", 100, no_setup, [&]()
+		{
+			for (size_t i = 0; i < 100; ++i)
+			{
+				lig.calculate_rf_score(pool[i % pool.size()], rec, *f);
+			}
+		});
+
+		// Decompose the free energy of results by residue.
+		{
+			vector<bool> mask(rec.residues.size());
+			vector<result> results;
+			bench("ligand_calculate_by_comp", 100, [&]()
+			{
+				results.clear();
+				for (size_t i = 0; i < 100; ++i)
+				{
+					results.push_back(pool[i % pool.size()]);
+				}
+			}, [&]()
+			{
+				for (auto& r : results)
+				{
+					lig.calculate_by_comp(r, sf, rec, mask);
+				}
+			});
+		}
+
+		// Output the report in JSON format.
+		ofstream ofs;
+		if (!out_path.empty())
+		{
+			ofs.open(out_path);
+		}
+		ostream& os = out_path.empty() ? cout : ofs;
+		os.setf(ios::fixed, ios::floatfield);
+		os << setprecision(1)
+			<< "{\n"
+			<< "  \"receptor\": " << json_quote(receptor_path.string()) << ",\n"
+			<< "  \"ligand\": " << json_quote(ligand_path.string()) << ",\n"
+			<< "  \"granularity\": " << setprecision(3) << granularity << setprecision(1) << ",\n"
+			<< "  \"trilinear\": " << (trilinear ? "true" : "false") << ",\n"
+			<< "  \"gradient_maps\": " << (gradient_maps ? "true" : "false") << ",\n"
+			<< "  \"blocked_maps\": " << (blocked_maps ? "true" : "false") << ",\n"
+			<< "  \"huge_pages\": " << (huge_pages ? "true" : "false") << ",\n"
+			<< "  \"warmups\": " << num_warmups << ",\n"
+			<< "  \"repetitions\": " << num_repetitions << ",\n"
+			<< "  \"unit\": \"ns/op\",\n"
+			<< "  \"kernels\": [";
+		for (size_t i = 0; i < kernels.size(); ++i)
+		{
+			const auto& k = kernels[i];
+			double sum = 0;
+			for (const auto v : k.ns)
+			{
+				sum += v;
+			}
+			os << (i ? ",\n" : "\n")
+				<< "    {\"name\": \"" << k.name << "\", \"ops_per_repetition\": " << k.num_ops
+				<< ", \"min\": " << k.percentile(0)
+				<< ", \"median\": " << k.percentile(50)
+				<< ", \"p90\": " << k.percentile(90)
+				<< ", \"p99\": " << k.percentile(99)
+				<< ", \"max\": " << k.percentile(100)
+				<< ", \"mean\": " << sum / k.ns.size();
+
+			// Report the events counted by the kernel, e.g. evaluations and BFGS iterations per local search.
+			bool first_event = true;
+			for (size_t e = 0; e < num_events; ++e)
+			{
+				if (!k.events[e]) continue;
+				os << (first_event ? ", \"events_per_op\": {" : ", ") << '"' << event_counts::names[e] << "\": " << setprecision(3) << static_cast<double>(k.events[e]) / (k.num_ops * k.ns.size()) << setprecision(1);
+				first_event = false;
+			}
+			os << (first_event ? "}" : "}}");
+		}
+		os << "\n  ]\n}\n";
+		if (!os)
+			throw runtime_error("failed to write the report");
+		return 0;
+	}
+	catch (const exception& e)
+	{
+		cerr << "ERROR: " << e.what() << endl;
+		return 2;
+	}
+}
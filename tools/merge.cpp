@@ -0,0 +1,230 @@
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <limits>
+#include <queue>
+#include <boost/program_options.hpp>
+#include "../src/string.hpp"
+using namespace std;
+using namespace std::filesystem;
+
+//! Represents a row of a log written by jdock.
+class row
+{
+public:
+	string line; //!< Raw line.
+	string stem; //!< Ligand file stem.
+	double score; //!< idock score, or infinity if no conformation is found.
+	size_t source; //!< Index of the log, or of the run when merging, the row comes from.
+
+	//! Parses a row from a line of a log with the given number of columns, unquoting the stem as jdock quotes it. Rows of ligands without conformations or with errors end early, but no row has more columns than the header. Throws invalid_argument on a malformed row.
+	explicit row(string&& line, const size_t source, const size_t num_columns) : line(move(line)), score(numeric_limits<double>::infinity()), source(source)
+	{
+		const auto fields = csv_split(this->line);
+		if (fields.size() > num_columns)
+			throw invalid_argument("more columns than the header in " + this->line);
+		stem = fields[0];
+
+		// The idock score is the 5th column, following the Atoms, Torsions and nConfs columns.
+		if (fields.size() > 4 && !fields[4].empty())
+		{
+			size_t end;
+			score = stod(fields[4], &end);
+			if (end != fields[4].size())
+				throw invalid_argument("malformed idock score in " + this->line);
+		}
+	}
+
+	//! Ranks rows by idock score, breaking ties by stem so that the merged log is deterministic.
+	bool operator<(const row& r) const
+	{
+		return score < r.score || (score == r.score && stem < r.stem);
+	}
+};
+
+//! Represents a sorted run of rows spilled to a temporary file, which is removed along with the run, also when merging fails.
+class run
+{
+public:
+	path p; //!< Path to the temporary file.
+	ifstream ifs; //!< Stream to read rows back.
+	size_t source; //!< Index of the log the rows come from.
+
+	explicit run(const path& p, const size_t source) : p(p), source(source)
+	{
+	}
+
+	//! Closes and removes the temporary file.
+	~run()
+	{
+		ifs.close();
+		error_code ec;
+		remove(p, ec);
+	}
+};
+
+int main(int argc, char* argv[])
+{
+	vector<path> input_paths;
+	path output_path, top_path;
+	size_t num_top, max_rows;
+
+	// Process program options.
+	try
+	{
+		using namespace boost::program_options;
+		options_description options("jdock_merge merges the logs of sharded jdock runs into one log ranked by idock score.\nUsage: jdock_merge -o merged.csv [options] shard_log ...\noptions");
+		options.add_options()
+			("input", value<vector<path>>(&input_paths)->required(), "logs of sharded runs, e.g. out/1AQ1_0_4.csv")
+			("out,o", value<path>(&output_path)->required(), "merged log ranked by idock score")
+			("top", value<size_t>(&num_top)->default_value(0), "number of top ranked ligands whose output conformations are collected")
+			("top_out", value<path>(&top_path), "folder to collect the output conformations of the top ranked ligands into, required by --top")
+			("max_rows", value<size_t>(&max_rows)->default_value(1000000), "maximum number of rows held in memory, beyond which sorted runs are spilled to temporary files")
+			("help", "this help information")
+			;
+		positional_options_description positional;
+		positional.add("input", -1);
+
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(options).positional(positional).run(), vm);
+		if (argc == 1 || vm.count("help"))
+		{
+			cout << options;
+			return 0;
+		}
+		vm.notify();
+
+		if (num_top && top_path.empty())
+		{
+			cerr << "Option top_out is required by option top" << endl;
+			return 1;
+		}
+		if (!max_rows)
+		{
+			cerr << "Option max_rows must be 1 or greater" << endl;
+			return 1;
+		}
+		if (num_top && !exists(top_path) && !create_directories(top_path))
+		{
+			cerr << "Failed to create output folder " << top_path << endl;
+			return 1;
+		}
+	}
+	catch (const exception& e)
+	{
+		cerr << "ERROR: " << e.what() << endl;
+		return 1;
+	}
+
+	try
+	{
+		// Sort the rows of every log in chunks of at most max_rows rows, and spill each chunk as a run, so that memory stays bounded regardless of the library size.
+		string header, line;
+		size_t num_columns = 0;
+		vector<unique_ptr<run>> runs;
+		vector<row> rows;
+		rows.reserve(min<size_t>(max_rows, 1 << 16));
+		const auto spill = [&](const size_t source)
+		{
+			if (rows.empty()) return;
+			sort(rows.begin(), rows.end());
+			runs.push_back(make_unique<run>(path(output_path).concat(".run" + to_string(runs.size())), source));
+			ofstream ofs(runs.back()->p);
+			for (const auto& r : rows)
+			{
+				ofs << r.line << '\n';
+			}
+			if (!ofs)
+				throw runtime_error("failed to write " + runs.back()->p.string());
+			rows.clear();
+		};
+		for (size_t s = 0; s < input_paths.size(); ++s)
+		{
+			ifstream ifs(input_paths[s]);
+			if (!ifs)
+				throw runtime_error("failed to open " + input_paths[s].string());
+			safe_getline(ifs, line);
+			if (s == 0)
+			{
+				header = line;
+				num_columns = csv_split(header).size();
+			}
+			else if (line != header)
+				throw runtime_error("the header of " + input_paths[s].string() + " differs from that of " + input_paths[0].string());
+			while (safe_getline(ifs, line))
+			{
+				if (line.empty()) continue;
+				try
+				{
+					rows.emplace_back(move(line), s, num_columns);
+				}
+				catch (const invalid_argument& e)
+				{
+					throw runtime_error(input_paths[s].string() + ": " + e.what());
+				}
+				if (rows.size() == max_rows) spill(s);
+			}
+			spill(s);
+		}
+		vector<row>().swap(rows);
+
+		// Merge the runs with a heap holding one row per run.
+		const auto greater = [](const row& a, const row& b)
+		{
+			return b < a;
+		};
+		priority_queue<row, vector<row>, decltype(greater)> heap(greater);
+		const auto next = [&](const size_t i)
+		{
+			while (safe_getline(runs[i]->ifs, line))
+			{
+				if (line.empty()) continue;
+				heap.emplace(move(line), i, num_columns);
+				return;
+			}
+		};
+		for (size_t i = 0; i < runs.size(); ++i)
+		{
+			runs[i]->ifs.open(runs[i]->p);
+			next(i);
+		}
+
+		ofstream ofs(output_path);
+		ofs << header << '\n';
+		size_t rank = 0;
+		while (!heap.empty())
+		{
+			const row r = heap.top();
+			heap.pop();
+			ofs << r.line << '\n';
+
+			// Collect the output conformations of a top ranked ligand, which are written next to the log of its shard.
+			if (rank++ < num_top && r.score != numeric_limits<double>::infinity())
+			{
+				const path folder = input_paths[runs[r.source]->source].parent_path();
+				for (const auto ext : { ".pdbqt", ".PDBQT" })
+				{
+					const path p = folder / (r.stem + ext);
+					if (exists(p))
+					{
+						copy_file(p, top_path / p.filename(), copy_options::overwrite_existing);
+						break;
+					}
+				}
+			}
+			next(r.source);
+		}
+		if (!ofs)
+			throw runtime_error("failed to write " + output_path.string());
+
+		// Remove the runs.
+		runs.clear();
+		cout << "Merged " << rank << " ligands from " << input_paths.size() << " logs into " << output_path << endl;
+		return 0;
+	}
+	catch (const exception& e)
+	{
+		cerr << "ERROR: " << e.what() << endl;
+		return 2;
+	}
+}
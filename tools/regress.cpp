@@ -0,0 +1,513 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <map>
+#include <random>
+#include <filesystem>
+#include <thread>
+#include <boost/program_options.hpp>
+#ifdef __linux__
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+extern char** environ;
+#endif
+#include "../src/stopwatch.hpp"
+#include "../src/string.hpp"
+using namespace std;
+using namespace std::filesystem;
+
+//! Represents the throughput of the jdock executable docking the ligands of an example complex with a number of threads.
+class run
+{
+public:
+	string example; //!< Example complex, e.g. 1AQ1/ZINC.
+	size_t num_threads; //!< Number of worker threads.
+	size_t num_dockings; //!< Number of ligands docked times number of seeds.
+	double wall_seconds; //!< Seconds of the jdock processes in the fastest repetition, from parsing the receptor and creating grid maps to writing the log.
+	size_t peak_rss_kb; //!< Peak resident set size of the jdock processes in KiB, or 0 if unavailable.
+
+	double ligands_per_second() const
+	{
+		return wall_seconds > 0 ? num_dockings / wall_seconds : 0;
+	}
+};
+
+//! Represents the idock score of the top pose of a ligand docked with a seed.
+class energy
+{
+public:
+	string example; //!< Example complex, e.g. 1AQ1/ZINC.
+	string ligand; //!< Ligand file stem.
+	size_t seed; //!< Seed.
+	double e; //!< idock score of the top pose, or infinity if no conformation is found.
+};
+
+//! Represents a temporary folder, which is removed along with its content on destruction.
+class temporary_folder
+{
+public:
+	const path p; //!< Path to the folder.
+
+	//! Creates a uniquely named folder in the temporary directory of the system.
+	explicit temporary_folder() : p(temp_directory_path() / ("jdock_regress_" + to_string(random_device()())))
+	{
+		create_directories(p);
+	}
+
+	~temporary_folder()
+	{
+		error_code ec;
+		remove_all(p, ec);
+	}
+
+	temporary_folder(const temporary_folder&) = delete;
+	temporary_folder& operator=(const temporary_folder&) = delete;
+};
+
+//! Runs a program with arguments, discarding its standard output, and returns its exit status. Saves the peak resident set size of the program in KiB into peak_rss_kb on Linux, or 0 elsewhere.
+static int execute(const vector<string>& args, size_t& peak_rss_kb)
+{
+	peak_rss_kb = 0;
+#ifdef __linux__
+	vector<char*> argv;
+	for (const auto& arg : args)
+	{
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	}
+	argv.push_back(nullptr);
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	pid_t pid;
+	const int error = posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (error)
+		throw runtime_error("failed to run " + args[0]);
+	int status;
+	rusage usage;
+	if (wait4(pid, &status, 0, &usage) != pid)
+		throw runtime_error("failed to wait for " + args[0]);
+	peak_rss_kb = usage.ru_maxrss;
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#else
+	string command;
+	for (const auto& arg : args)
+	{
+		command += '"' + arg + "\" ";
+	}
+#ifdef _WIN32
+	command = '"' + command + "> NUL\"";
+#else
+	command += "> /dev/null";
+#endif
+	return system(command.c_str());
+#endif
+}
+
+//! Returns the value of a key in a line of a report written by this program or of a summary written by jdock, without quotes if it is a string.
+static string field(const string& line, const string& key)
+{
+	const string pattern = '"' + key + "\": ";
+	const size_t pos = line.find(pattern);
+	if (pos == string::npos)
+		throw runtime_error("missing " + key + " in line " + line);
+	const size_t beg = pos + pattern.size();
+	if (line[beg] == '"')
+		return line.substr(beg + 1, line.find('"', beg + 1) - beg - 1);
+	return line.substr(beg, line.find_first_of(",}", beg) - beg);
+}
+
+//! Parses a comma separated list of non-negative integers, e.g. 1,2,4, dropping duplicates.
+static vector<size_t> parse_list(const string& list)
+{
+	vector<size_t> values;
+	istringstream iss(list);
+	for (string value; getline(iss, value, ',');)
+	{
+		const size_t v = stoul(value);
+		if (find(values.begin(), values.end(), v) == values.end())
+			values.push_back(v);
+	}
+	return values;
+}
+
+int main(int argc, char* argv[])
+{
+	path jdock_path, examples_path, baseline_path, out_path;
+	vector<string> example_names;
+	string threads_list, seeds_list;
+	size_t num_tasks, max_ligands, num_repeats;
+	double energy_tolerance, throughput_tolerance, rss_tolerance;
+	vector<size_t> thread_counts, seeds;
+
+	// Process program options.
+	try
+	{
+		using namespace boost::program_options;
+#ifdef _WIN32
+		const path default_jdock_path = path(argv[0]).parent_path() / "jdock.exe";
+#else
+		const path default_jdock_path = path(argv[0]).parent_path() / "jdock";
+#endif
+		options_description options("jdock_regress runs the jdock executable on the ligands of the bundled example complexes with fixed seeds at several thread counts, records throughput, peak memory and top pose energies from its logs, and compares them against a baseline report.\nUsage: jdock_regress [options]\nExit status is 3 if a regression against the baseline is found.\noptions");
+		options.add_options()
+			("jdock", value<path>(&jdock_path)->default_value(default_jdock_path), "jdock executable to run")
+			("examples", value<path>(&examples_path)->default_value("examples"), "folder of example complexes, each a subfolder with an idock.conf")
+			("example", value<vector<string>>(&example_names), "example complex to run, e.g. 1AQ1/ZINC, which may be repeated; all examples by default")
+			("threads", value<string>(&threads_list)->default_value("1," + to_string(max(1u, std::thread::hardware_concurrency()))), "comma separated numbers of worker threads")
+			("seeds", value<string>(&seeds_list)->default_value("1"), "comma separated seeds, each docking every ligand once")
+			("tasks", value<size_t>(&num_tasks)->default_value(8), "number of Monte Carlo tasks per ligand")
+			("max_ligands", value<size_t>(&max_ligands)->default_value(1), "maximum number of ligands per example, taken in alphabetical order")
+			("repeats", value<size_t>(&num_repeats)->default_value(1), "number of times to repeat every run, keeping the fastest")
+			("baseline", value<path>(&baseline_path), "report of a previous run to compare against")
+			("energy_tolerance", value<double>(&energy_tolerance)->default_value(0.01, "0.01"), "maximum absolute difference in kcal/mol of top pose energies from the baseline")
+			("throughput_tolerance", value<double>(&throughput_tolerance)->default_value(0.1, "0.1"), "maximum relative drop of ligands per second from the baseline")
+			("rss_tolerance", value<double>(&rss_tolerance)->default_value(0.1, "0.1"), "maximum relative growth of peak resident set size from the baseline")
+			("out,o", value<path>(&out_path), "report in JSON format, written to the standard output if omitted")
+			("help", "this help information")
+			;
+
+		variables_map vm;
+		store(parse_command_line(argc, argv, options), vm);
+		if (vm.count("help"))
+		{
+			cout << options;
+			return 0;
+		}
+		vm.notify();
+
+		if (!exists(jdock_path))
+		{
+			cerr << "Option jdock " << jdock_path << " does not exist" << endl;
+			return 1;
+		}
+		if (!is_directory(examples_path))
+		{
+			cerr << "Option examples " << examples_path << " is not a directory" << endl;
+			return 1;
+		}
+		if (!baseline_path.empty() && !exists(baseline_path))
+		{
+			cerr << "Option baseline " << baseline_path << " does not exist" << endl;
+			return 1;
+		}
+		try
+		{
+			thread_counts = parse_list(threads_list);
+			seeds = parse_list(seeds_list);
+		}
+		catch (const exception&)
+		{
+			cerr << "Option threads and seeds must be comma separated non-negative integers" << endl;
+			return 1;
+		}
+		if (thread_counts.empty() || find(thread_counts.begin(), thread_counts.end(), 0) != thread_counts.end())
+		{
+			cerr << "Option threads must be 1 or greater" << endl;
+			return 1;
+		}
+		if (seeds.empty())
+		{
+			cerr << "Option seeds must not be empty" << endl;
+			return 1;
+		}
+		if (!num_tasks)
+		{
+			cerr << "Option tasks must be 1 or greater" << endl;
+			return 1;
+		}
+		if (!max_ligands)
+		{
+			cerr << "Option max_ligands must be 1 or greater" << endl;
+			return 1;
+		}
+		if (!num_repeats)
+		{
+			cerr << "Option repeats must be 1 or greater" << endl;
+			return 1;
+		}
+
+		// Runs with different numbers of Monte Carlo tasks differ in both throughput and energies, so they are not comparable.
+		if (!baseline_path.empty())
+		{
+			size_t base_tasks = 0;
+			string line;
+			for (ifstream ifs(baseline_path); safe_getline(ifs, line);)
+			{
+				if (line.compare(0, 10, "  \"tasks\":") == 0)
+				{
+					base_tasks = stoul(field(line, "tasks"));
+					break;
+				}
+			}
+			if (base_tasks != num_tasks)
+			{
+				cerr << "Option tasks must match the " << base_tasks << " tasks of the baseline " << baseline_path << endl;
+				return 1;
+			}
+		}
+	}
+	catch (const exception& e)
+	{
+		cerr << "ERROR: " << e.what() << endl;
+		return 1;
+	}
+
+	try
+	{
+		// Enumerate the example complexes in alphabetical order.
+		if (example_names.empty())
+		{
+			for (const auto& complex : directory_iterator(examples_path))
+			{
+				if (!complex.is_directory()) continue;
+				for (const auto& set : directory_iterator(complex.path()))
+				{
+					if (exists(set.path() / "idock.conf"))
+						example_names.push_back(complex.path().filename().string() + '/' + set.path().filename().string());
+				}
+			}
+			sort(example_names.begin(), example_names.end());
+		}
+
+		const temporary_folder work;
+		vector<run> runs;
+		vector<energy> energies;
+		size_t num_failures = 0;
+		for (const auto& example_name : example_names)
+		{
+			// Load the receptor and ligands from the configuration file of the example, whose paths are relative to its folder. The box is read by jdock from the same file.
+			const path example_path = examples_path / example_name;
+			path receptor_path, ligand_path;
+			{
+				using namespace boost::program_options;
+				options_description options;
+				options.add_options()
+					("receptor", value<path>(&receptor_path)->required())
+					("ligand", value<path>(&ligand_path)->required())
+					;
+				variables_map vm;
+				ifstream ifs(example_path / "idock.conf");
+				store(parse_config_file(ifs, options, true), vm);
+				vm.notify();
+			}
+			receptor_path = example_path / receptor_path;
+			ligand_path = example_path / ligand_path;
+
+			// Copy the first ligands into a folder of their own, so that jdock runs its folder pipeline on them.
+			vector<path> ligand_paths;
+			if (is_regular_file(ligand_path))
+			{
+				ligand_paths.push_back(ligand_path);
+			}
+			else
+			{
+				for (const auto& entry : directory_iterator(ligand_path))
+				{
+					const auto ext = entry.path().extension();
+					if (ext == ".pdbqt" || ext == ".PDBQT")
+						ligand_paths.push_back(entry.path());
+				}
+				sort(ligand_paths.begin(), ligand_paths.end());
+			}
+			if (ligand_paths.size() > max_ligands)
+				ligand_paths.resize(max_ligands);
+			const path ligands_folder = work.p / "ligands";
+			remove_all(ligands_folder);
+			create_directories(ligands_folder);
+			for (const auto& p : ligand_paths)
+			{
+				copy_file(p, ligands_folder / p.filename());
+			}
+
+			const size_t first_energy = energies.size();
+			for (size_t k = 0; k < thread_counts.size(); ++k)
+			{
+				cerr << "Docking " << ligand_paths.size() << " ligands of " << example_name << " with " << thread_counts[k] << " threads" << endl;
+				run r;
+				r.example = example_name;
+				r.num_threads = thread_counts[k];
+				r.num_dockings = ligand_paths.size() * seeds.size();
+				r.peak_rss_kb = 0;
+
+				// Repeat the runs, keeping the fastest to damp the noise of the machine. Every repetition must score the same.
+				for (size_t rep = 0; rep < num_repeats; ++rep)
+				{
+					double wall_seconds = 0;
+					size_t i = first_energy;
+					for (const auto seed : seeds)
+					{
+						// Run jdock into an empty output folder, so that no ligand is skipped as docked already.
+						const path output_path = work.p / "out";
+						remove_all(output_path);
+						const auto sw = stopwatch::start_new();
+						size_t peak_rss_kb;
+						const int status = execute({ jdock_path.string(), "--config", (example_path / "idock.conf").string(), "--receptor", receptor_path.string(), "--ligand", ligands_folder.string(), "--out", output_path.string(), "--threads", to_string(thread_counts[k]), "--tasks", to_string(num_tasks), "--seed", to_string(seed) }, peak_rss_kb);
+						wall_seconds += sw.elapsed_sec();
+						r.peak_rss_kb = max(r.peak_rss_kb, peak_rss_kb);
+						if (status)
+							throw runtime_error("jdock exited with status " + to_string(status) + " on " + example_name);
+
+						// Check the summary that every ligand was docked.
+						const path log_stem = output_path / receptor_path.stem();
+						string line;
+						for (ifstream ifs(path(log_stem).concat(".json")); safe_getline(ifs, line);)
+						{
+							if (line.find("\"docked\"") != string::npos && stoul(field(line, "docked")) != ligand_paths.size())
+							{
+								cerr << "FAILURE: " << example_name << " seed " << seed << " docks " << field(line, "docked") << " of " << ligand_paths.size() << " ligands with " << thread_counts[k] << " threads" << endl;
+								++num_failures;
+							}
+						}
+
+						// Read the idock score of the top pose of every ligand from the 5th column of the log, which is empty if no conformation is found.
+						map<string, double> log_energies;
+						ifstream log(path(log_stem).concat(".csv"));
+						safe_getline(log, line);
+						while (safe_getline(log, line))
+						{
+							const auto fields = csv_split(line);
+							log_energies[fields[0]] = fields.size() > 4 && !fields[4].empty() ? stod(fields[4]) : numeric_limits<double>::infinity();
+						}
+
+						// Check that every ligand is logged and has its conformations written, and that it scores the same as with the first number of threads.
+						for (const auto& p : ligand_paths)
+						{
+							const string stem = p.stem().string();
+							const auto it = log_energies.find(stem);
+							if (it == log_energies.end())
+							{
+								cerr << "FAILURE: " << example_name << ' ' << stem << " seed " << seed << " is missing from the log with " << thread_counts[k] << " threads" << endl;
+								++num_failures;
+							}
+							const double e = it == log_energies.end() ? numeric_limits<double>::infinity() : it->second;
+							if (isfinite(e) && !exists(output_path / p.filename()))
+							{
+								cerr << "FAILURE: " << example_name << ' ' << stem << " seed " << seed << " has no conformations written with " << thread_counts[k] << " threads" << endl;
+								++num_failures;
+							}
+							if (k == 0 && rep == 0)
+							{
+								energies.push_back({ example_name, stem, seed, e });
+							}
+							else if (energies[i].e != e)
+							{
+								cerr << "MISMATCH: " << example_name << ' ' << stem << " seed " << seed << " scores " << e << " with " << thread_counts[k] << " threads but " << energies[i].e << " with " << thread_counts[0] << " threads" << endl;
+								++num_failures;
+							}
+							++i;
+						}
+					}
+					r.wall_seconds = rep ? min(r.wall_seconds, wall_seconds) : wall_seconds;
+				}
+				runs.push_back(r);
+			}
+		}
+
+		// Output the report in JSON format, one record per line so that it can be read back as a baseline.
+		ofstream ofs;
+		if (!out_path.empty())
+		{
+			ofs.open(out_path);
+		}
+		ostream& os = out_path.empty() ? cout : ofs;
+		os.setf(ios::fixed, ios::floatfield);
+		os << "{\n"
+			<< "  \"tasks\": " << num_tasks << ",\n"
+			<< "  \"runs\": [";
+		for (size_t i = 0; i < runs.size(); ++i)
+		{
+			const auto& r = runs[i];
+			os << (i ? ",\n" : "\n") << setprecision(3)
+				<< "    {\"example\": " << json_quote(r.example) << ", \"threads\": " << r.num_threads << ", \"dockings\": " << r.num_dockings
+				<< ", \"wall_seconds\": " << r.wall_seconds
+				<< ", \"ligands_per_second\": " << setprecision(4) << r.ligands_per_second() << ", \"peak_rss_kb\": " << r.peak_rss_kb << "}";
+		}
+		os << "\n  ],\n"
+			<< "  \"energies\": [";
+		for (size_t i = 0; i < energies.size(); ++i)
+		{
+			const auto& e = energies[i];
+			os << (i ? ",\n" : "\n") << setprecision(2)
+				<< "    {\"example\": " << json_quote(e.example) << ", \"ligand\": " << json_quote(e.ligand) << ", \"seed\": " << e.seed << ", \"energy\": ";
+
+			// JSON has no infinity, so a ligand without conformations is written as null.
+			if (isfinite(e.e))
+				os << e.e;
+			else
+				os << "null";
+			os << "}";
+		}
+		os << "\n  ]\n}\n";
+		if (!os)
+			throw runtime_error("failed to write the report");
+
+		// Compare against the baseline, matching runs by example and threads, and energies by example, ligand and seed.
+		size_t num_regressions = num_failures;
+		if (!baseline_path.empty())
+		{
+			map<pair<string, size_t>, const run*> current_runs;
+			for (const auto& r : runs)
+			{
+				current_runs[{ r.example, r.num_threads }] = &r;
+			}
+			map<tuple<string, string, size_t>, double> current_energies;
+			for (const auto& e : energies)
+			{
+				current_energies[{ e.example, e.ligand, e.seed }] = e.e;
+			}
+
+			string line;
+			size_t num_compared = 0;
+			for (ifstream ifs(baseline_path); safe_getline(ifs, line);)
+			{
+				if (line.find("\"wall_seconds\"") != string::npos)
+				{
+					const auto it = current_runs.find({ field(line, "example"), stoul(field(line, "threads")) });
+					if (it == current_runs.end()) continue;
+					++num_compared;
+					const run& r = *it->second;
+					const double base_throughput = stod(field(line, "ligands_per_second"));
+					const size_t base_rss = stoul(field(line, "peak_rss_kb"));
+					if (r.ligands_per_second() < base_throughput * (1 - throughput_tolerance))
+					{
+						cerr << "REGRESSION: " << r.example << " with " << r.num_threads << " threads docks " << r.ligands_per_second() << " ligands per second, below the baseline of " << base_throughput << endl;
+						++num_regressions;
+					}
+					if (base_rss && r.peak_rss_kb > base_rss * (1 + rss_tolerance))
+					{
+						cerr << "REGRESSION: " << r.example << " with " << r.num_threads << " threads peaks at " << r.peak_rss_kb << " KiB, above the baseline of " << base_rss << " KiB" << endl;
+						++num_regressions;
+					}
+				}
+				else if (line.find("\"energy\"") != string::npos)
+				{
+					const auto it = current_energies.find({ field(line, "example"), field(line, "ligand"), stoul(field(line, "seed")) });
+					if (it == current_energies.end()) continue;
+					++num_compared;
+					const string base_field = field(line, "energy");
+					const double base_e = base_field == "null" ? numeric_limits<double>::infinity() : stod(base_field);
+					if (!(abs(it->second - base_e) <= energy_tolerance) && it->second != base_e)
+					{
+						cerr << "REGRESSION: " << get<0>(it->first) << ' ' << get<1>(it->first) << " seed " << get<2>(it->first) << " scores " << it->second << " kcal/mol, off the baseline of " << base_e << endl;
+						++num_regressions;
+					}
+				}
+			}
+			if (!num_compared)
+				throw runtime_error("no record of the baseline " + baseline_path.string() + " matches an example, number of threads, ligand or seed of this run");
+			cerr << "Compared " << num_compared << " records against the baseline " << baseline_path << endl;
+		}
+		cerr << "Found " << num_regressions << " regressions" << endl;
+		return num_regressions ? 3 : 0;
+	}
+	catch (const exception& e)
+	{
+		cerr << "ERROR: " << e.what() << endl;
+		return 2;
+	}
+}